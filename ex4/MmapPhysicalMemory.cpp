@@ -0,0 +1,321 @@
+// the swap takes the page indices of every address space, whether VirtualMemory.cpp uses them or not
+#ifndef PM_ADDRESS_SPACES
+#define PM_ADDRESS_SPACES
+#endif
+#include "PhysicalMemory.h"
+#include "PhysicalMemoryExt.h"
+#include "MmapPhysicalMemory.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cassert>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+
+#define PAGE_BYTES (PAGE_SIZE * sizeof(word_t))
+/** num of pages the background thread copies to the file per batch, PMevict wakes it once a batch is queued */
+#define WRITEBACK_BATCH 64
+/** how long a batch that is not full may wait in the queue */
+#define WRITEBACK_DELAY_MS 10
+/** num of evicted pages that may wait in the queue before PMevict blocks */
+#define MAX_PENDING 4096
+/** num of pages the swap file starts with */
+#define INITIAL_SWAP_PAGES 1024
+#define DEFAULT_SWAP_FILE "vmswap.bin"
+
+typedef std::vector<word_t> page_t;
+
+/** the RAM, PMread and PMwrite may run on many threads at once */
+static word_t* RAM = NULL;
+
+/** guards everything below, PMevict and PMrestore already come one at a time from VirtualMemory.cpp */
+static std::mutex swapLock;
+/** wakes the background thread */
+static std::condition_variable queueFilled;
+/** wakes whoever waits for the background thread */
+static std::condition_variable queueFlushed;
+/** evicted pages that are not in the file yet, by page index */
+static std::unordered_map<uint64_t, page_t> pending;
+/** order to flush pending in, a page that was restored and dropped before its turn is skipped */
+static std::deque<uint64_t> queue;
+/** pages the background thread took out of pending and is copying to the file right now */
+static std::unordered_set<uint64_t> inFlight;
+/** place of every page that reached the file, a page keeps its place until PMdiscard or PMmmapReset */
+static std::unordered_map<uint64_t, uint64_t> slots;
+/** places that PMdiscard gave back, and the first place that was never given */
+static std::vector<uint64_t> freeSlots;
+static uint64_t nextSlot = 0;
+static int swapFd = -1;
+static word_t* swapFile = NULL;
+static bool stopping = false;
+/** someone waits for the queue to be flushed, don't wait for a full batch */
+static int waiters = 0;
+static PMmmapStats stats;
+static std::thread writer;
+
+/**
+ * print the error and exit
+ */
+static void systemError(const char* message){
+    fprintf(stderr, "system error: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * map the swap file with room for a num of pages, before the background thread starts or under swapLock with
+ * nothing in flight, the copies of the background thread run on the mapping without the lock
+ * @param pages
+ * @return false if the file can't grow or be mapped, the old mapping stays then
+ */
+static bool mapSwapFile(uint64_t pages){
+    if (ftruncate(swapFd, pages * PAGE_BYTES) != 0){
+        return false;
+    }
+    void* mapping = mmap(NULL, pages * PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, swapFd, 0);
+    if (mapping == MAP_FAILED){
+        return false;
+    }
+    if (swapFile != NULL){
+        munmap(swapFile, stats.swapPages * PAGE_BYTES);
+    }
+    swapFile = (word_t*)mapping;
+    stats.swapPages = pages;
+    return true;
+}
+
+/**
+ * give a page its place in the file if it has none, under swapLock. runs on the evicting thread and never on the
+ * background one, so the file only grows where a failure can be reported
+ * @param pageIndex
+ * @param lock
+ * @return false if the file is full and can't grow
+ */
+static bool reserveSlot(uint64_t pageIndex, std::unique_lock<std::mutex> &lock){
+    if (slots.count(pageIndex) != 0){
+        return true;
+    }
+    if (freeSlots.empty() && nextSlot == stats.swapPages){
+        queueFlushed.wait(lock, []{ return inFlight.empty(); });
+        if (!mapSwapFile(stats.swapPages * 2)){
+            return false;
+        }
+    }
+    if (!freeSlots.empty()){
+        slots[pageIndex] = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    else{
+        slots[pageIndex] = nextSlot++;
+    }
+    return true;
+}
+
+/**
+ * the background thread, copies the queue to the file a batch at a time
+ */
+static void writeBack(){
+    std::unique_lock<std::mutex> lock(swapLock);
+    std::vector<std::pair<uint64_t, page_t> > batch;
+    while (true) {
+        queueFilled.wait_for(lock, std::chrono::milliseconds(WRITEBACK_DELAY_MS),
+                             []{ return stopping || waiters != 0 || queue.size() >= WRITEBACK_BATCH; });
+        if (queue.empty()){
+            if (stopping){
+                return;
+            }
+            // nothing to flush, the waiters are already done, sleep without the lock until a page comes
+            queueFilled.wait(lock, []{ return stopping || !queue.empty(); });
+            continue;
+        }
+        // every queued page got its place when it was evicted, and the file doesn't move while pages are in
+        // flight, so the copies can run without the lock
+        while (!queue.empty() && batch.size() < WRITEBACK_BATCH) {
+            uint64_t pageIndex = queue.front();
+            queue.pop_front();
+            std::unordered_map<uint64_t, page_t>::iterator page = pending.find(pageIndex);
+            if (page == pending.end()){
+                continue;
+            }
+            batch.push_back(std::make_pair(slots[pageIndex], page_t()));
+            batch.back().second.swap(page->second);
+            pending.erase(page);
+            inFlight.insert(pageIndex);
+        }
+        std::vector<uint64_t> written(inFlight.begin(), inFlight.end());
+        word_t* file = swapFile;
+        lock.unlock();
+        for (size_t i = 0; i < batch.size(); i++) {
+            memcpy(file + batch[i].first * PAGE_SIZE, batch[i].second.data(), PAGE_BYTES);
+        }
+        lock.lock();
+        stats.flushedPages += batch.size();
+        stats.batches++;
+        batch.clear();
+        for (size_t i = 0; i < written.size(); i++) {
+            inFlight.erase(written[i]);
+        }
+        queueFlushed.notify_all();
+    }
+}
+
+/**
+ * wait until the background thread has nothing left, under swapLock
+ */
+static void waitForWriteBack(std::unique_lock<std::mutex> &lock){
+    waiters++;
+    queueFilled.notify_one();
+    queueFlushed.wait(lock, []{ return pending.empty() && inFlight.empty(); });
+    waiters--;
+}
+
+/**
+ * maps the RAM and the swap before main, stops the background thread after it
+ */
+struct MmapSetup {
+    MmapSetup() {
+        void* mapping = mmap(NULL, RAM_SIZE * sizeof(word_t), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED){
+            systemError("can't map the RAM");
+        }
+        RAM = (word_t*)mapping;
+        const char* path = getenv("VM_SWAP_FILE");
+        // a file that is already there is not ours to truncate and unlink
+        swapFd = open(path != NULL ? path : DEFAULT_SWAP_FILE, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (swapFd < 0){
+            systemError("can't create the swap file, it may already exist");
+        }
+        // the swap means nothing after the process is gone, so it has no name while it is in use
+        unlink(path != NULL ? path : DEFAULT_SWAP_FILE);
+        if (!mapSwapFile(INITIAL_SWAP_PAGES)){
+            systemError("can't map the swap file");
+        }
+        writer = std::thread(writeBack);
+    }
+    ~MmapSetup() {
+        {
+            std::lock_guard<std::mutex> guard(swapLock);
+            stopping = true;
+        }
+        queueFilled.notify_one();
+        writer.join();
+        munmap(swapFile, stats.swapPages * PAGE_BYTES);
+        munmap(RAM, RAM_SIZE * sizeof(word_t));
+        close(swapFd);
+    }
+};
+static MmapSetup setup;
+
+void PMread(uint64_t physicalAddress, word_t* value){
+    assert(physicalAddress < RAM_SIZE);
+    *value = RAM[physicalAddress];
+}
+
+void PMwrite(uint64_t physicalAddress, word_t value){
+    assert(physicalAddress < RAM_SIZE);
+    RAM[physicalAddress] = value;
+}
+
+void PMevict(uint64_t frameIndex, uint64_t evictedPageIndex){
+    assert(frameIndex < NUM_FRAMES);
+    assert(evictedPageIndex < NUM_SWAP_PAGES);
+    std::unique_lock<std::mutex> lock(swapLock);
+    queueFlushed.wait(lock, []{ return pending.size() < MAX_PENDING; });
+    if (!reserveSlot(evictedPageIndex, lock)){
+        // exit runs the destructor below, it takes the lock
+        lock.unlock();
+        systemError("can't grow the swap file");
+    }
+    stats.evicts++;
+    std::pair<std::unordered_map<uint64_t, page_t>::iterator, bool> page =
+            pending.insert(std::make_pair(evictedPageIndex, page_t()));
+    page.first->second.assign(RAM + frameIndex * PAGE_SIZE, RAM + (frameIndex + 1) * PAGE_SIZE);
+    if (page.second){
+        queue.push_back(evictedPageIndex);
+        if (queue.size() == 1 || queue.size() == WRITEBACK_BATCH || pending.size() == MAX_PENDING){
+            queueFilled.notify_one();
+        }
+    }
+    else{
+        stats.coalesced++;
+    }
+}
+
+void PMrestore(uint64_t frameIndex, uint64_t restoredPageIndex){
+    assert(frameIndex < NUM_FRAMES);
+    assert(restoredPageIndex < NUM_SWAP_PAGES);
+    std::unique_lock<std::mutex> lock(swapLock);
+    stats.restores++;
+    // the copy on its way to the file is the newest one, unless the page was evicted again meanwhile
+    queueFlushed.wait(lock, [=]{ return inFlight.count(restoredPageIndex) == 0; });
+    std::unordered_map<uint64_t, page_t>::iterator page = pending.find(restoredPageIndex);
+    std::unordered_map<uint64_t, uint64_t>::iterator slot = slots.find(restoredPageIndex);
+    if (page != pending.end()){
+        stats.queueHits++;
+        memcpy(RAM + frameIndex * PAGE_SIZE, page->second.data(), PAGE_BYTES);
+    }
+    else if (slot != slots.end()){
+        stats.fileHits++;
+        memcpy(RAM + frameIndex * PAGE_SIZE, swapFile + slot->second * PAGE_SIZE, PAGE_BYTES);
+    }
+}
+
+void PMzeroFrame(uint64_t frameIndex){
+    assert(frameIndex < NUM_FRAMES);
+    memset(RAM + frameIndex * PAGE_SIZE, 0, PAGE_BYTES);
+}
+
+bool PMhasSwapCopy(uint64_t pageIndex){
+    std::lock_guard<std::mutex> guard(swapLock);
+    return pending.count(pageIndex) != 0 || inFlight.count(pageIndex) != 0 || slots.count(pageIndex) != 0;
+}
+
+void PMdiscard(uint64_t pageIndex){
+    assert(pageIndex < NUM_SWAP_PAGES);
+    std::unique_lock<std::mutex> lock(swapLock);
+    // the page may still be on its way to its place in the file
+    queueFlushed.wait(lock, [=]{ return inFlight.count(pageIndex) == 0; });
+    pending.erase(pageIndex);
+    std::unordered_map<uint64_t, uint64_t>::iterator slot = slots.find(pageIndex);
+    if (slot != slots.end()){
+        freeSlots.push_back(slot->second);
+        slots.erase(slot);
+    }
+}
+
+void PMmmapSync(){
+    std::unique_lock<std::mutex> lock(swapLock);
+    waitForWriteBack(lock);
+    if (msync(swapFile, stats.swapPages * PAGE_BYTES, MS_SYNC) != 0){
+        lock.unlock();
+        systemError("can't sync the swap file");
+    }
+}
+
+void PMmmapReset(){
+    std::unique_lock<std::mutex> lock(swapLock);
+    waitForWriteBack(lock);
+    queue.clear();
+    slots.clear();
+    freeSlots.clear();
+    nextSlot = 0;
+    uint64_t swapPages = stats.swapPages;
+    memset(&stats, 0, sizeof(stats));
+    stats.swapPages = swapPages;
+    memset(RAM, 0, RAM_SIZE * sizeof(word_t));
+}
+
+void PMmmapGetStats(PMmmapStats* copy){
+    std::lock_guard<std::mutex> guard(swapLock);
+    *copy = stats;
+}
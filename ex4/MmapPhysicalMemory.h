@@ -0,0 +1,50 @@
+#pragma once
+
+#include "MemoryConstants.h"
+
+/*
+ * physical memory over mmap, for MmapPhysicalMemory.cpp. it implements PhysicalMemory.h and all the
+ * functions of PhysicalMemoryExt.h, and it keeps the swap copy of a page on PMrestore, so VirtualMemory.cpp
+ * may be built with -DPM_RESTORE_KEEPS_COPY -DPM_ZERO_OPS -DPM_ADDRESS_SPACES on top of it. the backend
+ * itself is always built for MAX_SPACES * NUM_PAGES swap pages, with or without the flags.
+ *
+ * the RAM is one anonymous mapping that PMread and PMwrite index directly. the swap is a file mapped
+ * shared, VM_SWAP_FILE names it (default vmswap.bin in the working directory). the file must not exist,
+ * it is created and unlinked as soon as it is open. PMevict only copies the page to a write-back queue,
+ * a background thread copies the queue to the file in batches, and PMrestore takes a page from the queue
+ * if it is not in the file yet.
+ */
+
+/**
+ * what the write-back saw since the start or the last PMmmapReset
+ */
+typedef struct PMmmapStats{
+    uint64_t evicts;
+    uint64_t restores;
+    /** restores served by the write-back queue, before the page reached the file */
+    uint64_t queueHits;
+    /** restores read from the file */
+    uint64_t fileHits;
+    /** evictions of a page that was still queued, they replaced the queued copy */
+    uint64_t coalesced;
+    /** pages the background thread copied to the file, and num of batches it took */
+    uint64_t flushedPages;
+    uint64_t batches;
+    /** num of pages the swap file has room for, it doubles when it is full */
+    uint64_t swapPages;
+} PMmmapStats;
+
+/**
+ * wait until the write-back queue is empty and the file is synced to the disk
+ */
+void PMmmapSync();
+
+/**
+ * wait for the write-back, then zero the RAM, drop the swap and zero the stats
+ */
+void PMmmapReset();
+
+/**
+ * @param stats where to copy the counters
+ */
+void PMmmapGetStats(PMmmapStats* stats);
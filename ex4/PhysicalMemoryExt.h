@@ -0,0 +1,39 @@
+#pragma once
+
+#include "MemoryConstants.h"
+#include "VirtualMemoryExt.h"
+
+/*
+ * optional extras of the physical memory, VirtualMemory.cpp only uses them when built with the macro
+ * that names them:
+ *
+ * PM_RESTORE_KEEPS_COPY - PMrestore leaves the page in the swap and PMevict overwrites it, so a clean
+ *                         page can be dropped without PMevict.
+ * PM_ZERO_OPS           - the physical memory has PMzeroFrame and PMhasSwapCopy.
+ * PM_ADDRESS_SPACES     - the swap takes page indices up to NUM_SWAP_PAGES instead of NUM_PAGES, one run of
+ *                         NUM_PAGES per address space, and the physical memory has PMdiscard.
+ */
+
+#ifdef PM_ADDRESS_SPACES
+#define NUM_SWAP_PAGES (MAX_SPACES * NUM_PAGES)
+#else
+#define NUM_SWAP_PAGES NUM_PAGES
+#endif
+
+/**
+ * set every word of a frame to 0
+ * @param frameIndex
+ */
+void PMzeroFrame(uint64_t frameIndex);
+
+/**
+ * @param pageIndex
+ * @return true if the swap holds the page, false if it was never evicted
+ */
+bool PMhasSwapCopy(uint64_t pageIndex);
+
+/**
+ * drop a page from the swap, nothing if the swap does not hold it
+ * @param pageIndex
+ */
+void PMdiscard(uint64_t pageIndex);
@@ -1,37 +1,385 @@
 #include "VirtualMemory.h"
+#include "VirtualMemoryExt.h"
 #include "PhysicalMemory.h"
+#include "PhysicalMemoryExt.h"
 #include <cmath>
+#include <climits>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cstring>
+
+#define HUGE_PAGE_BIT ((word_t)1 << (sizeof(word_t) * CHAR_BIT - 2))
+#define DIRTY_PAGE_BIT ((word_t)1 << (sizeof(word_t) * CHAR_BIT - 3))
+#define COW_PAGE_BIT ((word_t)1 << (sizeof(word_t) * CHAR_BIT - 4))
+#define FRAME_MASK (COW_PAGE_BIT - 1)
+/** num of entries in the translation cache is 1 << TLB_BITS */
+#define TLB_BITS 6
+#define TLB_SIZE (1 << TLB_BITS)
+
+#ifdef VM_STATS
+#define COUNT(counter) (counter).fetch_add(1, std::memory_order_relaxed)
+#else
+#define COUNT(counter)
+#endif
+
+/** who made a physical access, for the counters */
+enum AccessKind {WALK_ACCESS, SEARCH_ACCESS, DATA_ACCESS};
+
+#ifdef VM_STATS
+/**
+ * same fields as VMStats, atomic because hits count without the fault lock
+ */
+struct StatCounters {
+    std::atomic<uint64_t> reads;
+    std::atomic<uint64_t> writes;
+    std::atomic<uint64_t> pageFaults;
+    std::atomic<uint64_t> tableAllocations;
+    std::atomic<uint64_t> evictionFallbacks;
+    std::atomic<uint64_t> evictions;
+    std::atomic<uint64_t> cleanDrops;
+    std::atomic<uint64_t> zeroFills;
+    std::atomic<uint64_t> zeroPageReads;
+    std::atomic<uint64_t> tlbHits;
+    std::atomic<uint64_t> tlbMisses;
+    std::atomic<uint64_t> cowCopies;
+    std::atomic<uint64_t> pmEvictCalls;
+    std::atomic<uint64_t> pmRestoreCalls;
+    std::atomic<uint64_t> physicalReads[DATA_ACCESS + 1];
+    std::atomic<uint64_t> physicalWrites[DATA_ACCESS + 1];
+    std::atomic<uint64_t> walkLength[TABLES_DEPTH + 1];
+    std::atomic<uint64_t> searchDepth[TABLES_DEPTH + 1];
+};
+static StatCounters counters;
+#endif
+
+/** serialises page faults, evictions and every other change to the tables */
+static std::mutex faultLock;
+/** odd while the tables are changing, lock free readers retry if it moved under them */
+static std::atomic<uint64_t> tableVersion(0);
+/** num of lock free writers in the middle of a write, changes to the tables wait for them */
+static std::atomic<int> activeWriters(0);
+
+/**
+ * holds the fault lock and marks the tables as changing for as long as it lives
+ */
+struct TableUpdate {
+    TableUpdate() : guard(faultLock) {
+        tableVersion.fetch_add(1);
+        while (activeWriters.load() != 0) {
+            std::this_thread::yield();
+        }
+    }
+    ~TableUpdate() {
+        tableVersion.fetch_add(1, std::memory_order_release);
+    }
+    std::lock_guard<std::mutex> guard;
+};
+
+/**
+ * a virtual address space, its tables hang from its own root frame
+ */
+struct AddressSpace {
+    bool live;
+    word_t root;
+    /** num of threads that switched to it and did not switch away, the lock free paths read its root */
+    int users;
+    /**
+     * swapped[page] is true once the page went to the swap. it stays true after a restore, so a page that
+     * has it false is all zeros unless it was written since it came in
+     */
+    std::vector<bool> swapped;
+    /** num of levels of each huge page by the page it starts at, it stays after an eviction */
+    std::map<uint64_t, unsigned char> hugeLevels;
+};
+/** space 0 is the one VMinitialize() sets up, its root is frame 0 */
+static AddressSpace spaces[MAX_SPACES] = {{true, 0, 0, std::vector<bool>(), std::map<uint64_t, unsigned char>()}};
+/** the space that VMread and VMwrite of this thread use */
+static thread_local int currentSpace = 0;
+
+/**
+ * leaves the current space of a thread when the thread exits, so it can be destroyed
+ */
+struct SpaceUser {
+    ~SpaceUser() {
+        std::lock_guard<std::mutex> guard(faultLock);
+        if (currentSpace != 0){
+            spaces[currentSpace].users--;
+        }
+    }
+};
+static thread_local SpaceUser spaceUser;
+/** num of spaces that map a frame copy on write, only meaningful while an entry with COW_PAGE_BIT points to it */
+static int frameSharers[NUM_FRAMES];
+
+/**
+ * cached translation of one page, tag is the swap key of the page plus one so 0 means empty.
+ * filled and invalidated only under the fault lock, lock free readers check tableVersion like for the tables
+ */
+struct TlbEntry {
+    std::atomic<uint64_t> tag;
+    std::atomic<word_t> entry;
+};
+static TlbEntry tlb[TLB_SIZE];
+
+/**
+ * a leaf of a table tree, a page or a huge page
+ */
+struct Leaf {
+    uint64_t address;
+    /** num of entries on the way from the root, as unlinkMax() takes it */
+    int depth;
+    word_t entry;
+};
 
 /**
  * find the right frame to write value
+ * @param space address space
+ * @param virtualAddress
+ * @param numOfBitsInP num of bit in every p^i address
+ * @param markDirty true if the page is about to be written
+ * @return frame, NUM_FRAMES if there was no frame for a missing table or page
+ */
+word_t getFrameOfVirtualAddress(int space, uint64_t virtualAddress, uint64_t numOfBitsInP, bool markDirty);
+/**
+ * walk down the tables and create the missing ones, stop early on a huge page.
+ * a write to a page that is shared copy on write gets its own copy on the way
+ * @param space address space
  * @param virtualAddress
  * @param numOfBitsInP num of bit in every p^i address
- * @return frame
+ * @param lastLevel level to stop at, TABLES_DEPTH is the root and 0 walks all the way to the page
+ * @param markDirty set the dirty bit of the page (or huge page) the walk ends on
+ * @param isHuge set to true if the walk ended on a huge page
+ * @return frame of the table at lastLevel, or frame of the page, NUM_FRAMES if there was no frame for a missing
+ * table or page
+ */
+word_t walkToLevel(int space, uint64_t virtualAddress, uint64_t numOfBitsInP, int lastLevel, bool markDirty,
+                   bool &isHuge);
+/**
+ * give a page that is shared copy on write a frame of its own, or just drop the sharing if it is the last mapper
+ * @param space address space that writes
+ * @param tableFrame frame of the table that holds the entry
+ * @param P_Address index of the entry in the table
+ * @param entry the entry, with COW_PAGE_BIT
+ * @param virtualAddress
+ * @return the new entry, already written to the table, 0 if there is no frame for the copy
+ */
+word_t copyOnWrite(int space, word_t tableFrame, uint64_t P_Address, word_t entry, uint64_t virtualAddress);
+/**
+ * count a walk that reached a page
+ * @param lastLevel level the walk stopped at, walks that stopped at a table are not counted
+ * @param entriesRead num of table entries the walk read
+ * @param faulted true if the walk found a missing table or page
+ */
+void countWalk(int lastLevel, int entriesRead, bool faulted);
+/**
+ * find the frame of a page that is already mapped, without changing the tables
+ * @param space address space
+ * @param virtualAddress
+ * @param frame frame of the page
+ * @param needDirty fail if the page is not marked dirty yet
+ * @param entriesRead num of table entries the walk read, the caller counts it once the walk turns out valid
+ * @return true if every table on the way exists
+ */
+bool tryTranslate(int space, uint64_t virtualAddress, word_t &frame, bool needDirty, int &entriesRead);
+/**
+ * read the entry that maps a page, without changing the tables
+ * @param space address space
+ * @param virtualAddress
+ * @return the page (or huge page) entry, 0 if the page is not mapped
+ */
+word_t readLeafEntry(int space, uint64_t virtualAddress);
+/**
+ * key of a page in the swap and in the translation cache, space * NUM_PAGES + pageIndex, below NUM_SWAP_PAGES.
+ * pages of space 0 keep their own index
+ */
+uint64_t swapKey(int space, uint64_t pageIndex);
+/**
+ * entry of the translation cache that a page goes to, the xor of all the TLB_BITS chunks of the key. keys of
+ * other spaces and of far apart regions differ in high bits only, and neighbour pages still get different slots
+ * @param key swapKey() of the page
  */
-word_t getFrameOfVirtualAddress(uint64_t virtualAddress, uint64_t numOfBitsInP);
+inline uint64_t tlbSlot(uint64_t key);
 /**
- * find empty frame to write value
+ * look a page up in the translation cache, safe without the fault lock
+ * @param key swapKey() of the page
+ * @param needWritable miss if the page is clean or shared copy on write
+ * @param frame frame of the page
+ * @return true on a hit
+ */
+bool tlbLookup(uint64_t key, bool needWritable, word_t &frame);
+/**
+ * cache the translation of a page, under the fault lock only
+ * @param key swapKey() of the page
+ * @param entry frame of the page, with DIRTY_PAGE_BIT if it may be written
+ */
+void tlbFill(uint64_t key, word_t entry);
+/**
+ * drop every cached translation to a run of frames
+ * @param firstFrame
+ * @param span num of frames
+ */
+void tlbInvalidate(word_t firstFrame, uint64_t span);
+/**
+ * drop every cached translation of a space
+ * @param space
+ */
+void tlbInvalidateSpace(int space);
+/**
+ * PMread that counts the access
+ * @param physicalAddress
+ * @param value
+ * @param kind who reads
+ */
+inline void readWord(uint64_t physicalAddress, word_t* value, AccessKind kind);
+/**
+ * PMwrite that counts the access
+ * @param physicalAddress
+ * @param value
+ * @param kind who writes
+ */
+inline void writeWord(uint64_t physicalAddress, word_t value, AccessKind kind);
+/**
+ * PMevict of a page of a space, counts the call
+ */
+inline void evictPage(uint64_t frameIndex, int space, uint64_t evictedPageIndex);
+/**
+ * PMrestore of a page of a space, counts the call
+ */
+inline void restorePage(uint64_t frameIndex, int space, uint64_t restoredPageIndex);
+/**
+ * check if any page of a run ever went to the swap
+ * @param space
+ * @param firstPage
+ * @param span num of pages
+ */
+bool wasSwapped(int space, uint64_t firstPage, uint64_t span);
+/**
+ * read a page that is already mapped without taking the fault lock
+ * @param virtualAddress
+ * @param value
+ * @return true on success, false if the caller has to take the slow path
+ */
+bool readMappedPage(uint64_t virtualAddress, word_t* value);
+/**
+ * write to a page that is already mapped without taking the fault lock
+ * @param virtualAddress
+ * @param value
+ * @return true on success, false if the caller has to take the slow path
+ */
+bool writeMappedPage(uint64_t virtualAddress, word_t value);
+/**
+ * find empty frame to write value, in the tables of all spaces
  * @param current frame that we dont want to return
+ * @param isZero set to true if the frame is known to be all zeros already
  * @return empty frame if exist
  */
-int findEmptyFrame(word_t current);
+int findEmptyFrame(word_t current, bool &isZero);
+/**
+ * find empty frame, evict a page if there is none
+ * @param current frame that we dont want to return
+ * @param virtualAddress address that needs the frame
+ * @param currentDepth depth in tree of the table that needs the frame
+ * @param isZero set to true if the frame is known to be all zeros already
+ * @return frame, 0 if there is nothing to evict
+ */
+word_t allocateFrame(word_t current, uint64_t virtualAddress, int currentDepth, bool &isZero);
+/**
+ * unlink an empty table of one of the spaces
+ * @param current frame that we dont want to return
+ * @return the table, -1 if there is none
+ */
+int findEmptyTable(word_t current);
+/**
+ * fill a frame that was just mapped to a page, from the swap or with zeros
+ * @param frameIndex
+ * @param space
+ * @param pageIndex
+ * @param isZero true if the frame is known to be all zeros already
+ */
+void bringPageIn(uint64_t frameIndex, int space, uint64_t pageIndex, bool isZero);
+/**
+ * true if the page has no frame and no copy in the swap, so it reads as zeros
+ * @param space
+ * @param virtualAddress
+ */
+bool isUntouchedPage(int space, uint64_t virtualAddress);
+/**
+ * read a page that has no frame and no copy in the swap as the shared zero page. it takes only the fault lock,
+ * the tables can't change under it, so lock free readers don't have to retry and writers don't wait
+ * @param virtualAddress
+ * @param value set to 0
+ * @return true if the page was untouched, false if the caller has to take the slow path
+ */
+bool readUntouchedPage(uint64_t virtualAddress, word_t* value);
 /**
  * run on frames that already connect to root of tree by recursion, and return the empty frame
- * @param frame 0
+ * @param frame root
  * @param depth 0
  * @param current current address
  * @param address 0
  * @param flag
+ * @param root root of the tree
  * @return num of empty frame if exist, -1 if not
  */
-int dfs1(word_t frame, int depth, word_t current, uint64_t address, bool &flag);
+int dfs1(word_t frame, int depth, word_t current, uint64_t address, bool &flag, word_t root);
 /**
  * run of all tree by recursion, and return the max frame that possessed
  * @param frame 0
  * @param depth 0
  * @param max the max frame that already possessed
+ * @param referenced num of frames that possessed
+ * @param used if not NULL, mark every possessed frame
+ */
+void dfs2(word_t frame, int depth, int &max, int &referenced, std::vector<bool> *used);
+/**
+ * dfs2() on the trees of all spaces, roots included
+ * @param max the max frame that already possessed
+ * @param referenced num of frames that possessed, frames shared copy on write count once per space
+ * @param used if not NULL, mark every possessed frame
+ */
+void scanSpaces(int &max, int &referenced, std::vector<bool> *used);
+/**
+ * list the pages and huge pages of a tree
+ * @param frame root
+ * @param depth 0
+ * @param address 0
+ * @param leaves where to add them
  */
-void dfs2(word_t frame, int depth, int &max);
+void collectLeaves(word_t frame, int depth, uint64_t address, std::vector<Leaf> &leaves);
+/**
+ * find frames that no table points to, huge pages that were evicted leave such holes
+ * @param span num of contiguous frames that needed
+ * @return first frame of the run, NUM_FRAMES if not exist
+ */
+int findUnusedFrames(uint64_t span);
+/**
+ * check if a space mapped the region around an address as a huge page, even if it is in the swap now
+ * @param space
+ * @param virtualAddress
+ * @param levels num of table levels that the huge page replaces
+ */
+bool isHugeRegion(int space, uint64_t virtualAddress, int levels);
+/**
+ * map a huge page as one unit, its pages that are in the swap are restored
+ * @param space
+ * @param tableFrame table that gets the huge entry
+ * @param P_Address index of the entry in the table
+ * @param virtualAddress any address in the huge page
+ * @param levels num of table levels that the huge page replaces
+ * @param entryBits added to the entry, DIRTY_PAGE_BIT or 0
+ * @return first frame of the run, NUM_FRAMES if there is no free run of frames
+ */
+word_t installHuge(int space, word_t tableFrame, uint64_t P_Address, uint64_t virtualAddress, int levels,
+                   word_t entryBits);
+/**
+ * num of pages that a huge page maps
+ * @param levelsBelow num of table levels that the huge page replaces
+ * @return num of pages
+ */
+uint64_t hugePageSpan(int levelsBelow);
 /**
  * built the address of frame, by add bits to the and of address
  * @param address old address
@@ -40,12 +388,21 @@ void dfs2(word_t frame, int depth, int &max);
  */
 void constructAddressOfFrame (uint64_t &address, int depth, word_t indexOfFrame);
 /**
- * main function that frame to free its old value and add new one
+ * main function that frame to free its old value and add new one, the victim may be in any space
+ * (0 if there is no page to evict)
  * @param virtualAddress the address of the father
  * @param currentDepth current depth in tree
  * @return right frame
  */
 word_t findFrameToFreeWrapper(uint64_t virtualAddress, int currentDepth);
+/**
+ * unlink a page (or huge page) and write it to the swap, from every space that shares it
+ * @param space
+ * @param address virtual address of the page
+ * @param depth num of entries on the way to it
+ * @return its frame
+ */
+word_t evictLeaf(int space, uint64_t address, int depth);
 /**
  * find the frame that we looking for
  * @param indexOfFrame
@@ -79,17 +436,33 @@ void checkMax(unsigned int even, unsigned int odd, uint64_t &address, uint64_t &
  * read from frame exist value
  * @param virtualAddress address
  * @param depth depth
+ * @param root root of the tree
  * @return right frame
  */
-word_t simpleVMread(uint64_t virtualAddress, int depth);
+word_t simpleVMread(uint64_t virtualAddress, int depth, word_t root);
 /**
  * free all lines of the frame that we choose as right frame
  * @param maxAddress virtual address
  * @param depthOfMax depth
+ * @param root root of the tree
  */
-void unlinkMax(uint64_t maxAddress, int depthOfMax);
-
-void clearTable(uint64_t frameIndex);
+void unlinkMax(uint64_t maxAddress, int depthOfMax, word_t root);
+/**
+ * take a free slot and give it an empty root, under the fault lock
+ * @return the space, -1 if there is no free slot or no frame for the root
+ */
+int createSpace();
+/**
+ * drop a space, under the fault lock
+ * @param space
+ */
+void destroySpace(int space);
+/**
+ * zero every word of a frame
+ * @param frameIndex
+ * @param kind who zeroes, for the counters
+ */
+void clearTable(uint64_t frameIndex, AccessKind kind);
 /**
  * create num with ones in size of chunk of p^i address
  * @param numOfBitsInP num of ones
@@ -99,33 +472,250 @@ uint64_t createOnes(uint64_t numOfBitsInP);
 
 
 
+inline void readWord(uint64_t physicalAddress, word_t* value, AccessKind kind){
+    COUNT(counters.physicalReads[kind]);
+    PMread(physicalAddress, value);
+}
+
+inline void writeWord(uint64_t physicalAddress, word_t value, AccessKind kind){
+    COUNT(counters.physicalWrites[kind]);
+    PMwrite(physicalAddress, value);
+}
+
+inline void evictPage(uint64_t frameIndex, int space, uint64_t evictedPageIndex){
+    COUNT(counters.pmEvictCalls);
+    if (spaces[space].swapped.empty()){
+        spaces[space].swapped.resize(NUM_PAGES, false);
+    }
+    spaces[space].swapped[evictedPageIndex] = true;
+    PMevict(frameIndex, swapKey(space, evictedPageIndex));
+}
+
+inline void restorePage(uint64_t frameIndex, int space, uint64_t restoredPageIndex){
+    COUNT(counters.pmRestoreCalls);
+    PMrestore(frameIndex, swapKey(space, restoredPageIndex));
+}
+
+bool wasSwapped(int space, uint64_t firstPage, uint64_t span){
+    if (spaces[space].swapped.empty()){
+        return false;
+    }
+    for (uint64_t j = 0; j < span; j++) {
+        if (spaces[space].swapped[firstPage + j]){
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t swapKey(int space, uint64_t pageIndex){
+    return space * NUM_PAGES + pageIndex;
+}
+
+inline uint64_t tlbSlot(uint64_t key){
+    uint64_t slot = 0;
+    for (; key != 0; key >>= TLB_BITS) {
+        slot ^= key;
+    }
+    return slot & (TLB_SIZE - 1);
+}
+
+bool tlbLookup(uint64_t key, bool needWritable, word_t &frame){
+    TlbEntry &cached = tlb[tlbSlot(key)];
+    if (cached.tag.load(std::memory_order_relaxed) != key + 1){
+        COUNT(counters.tlbMisses);
+        return false;
+    }
+    word_t entry = cached.entry.load(std::memory_order_relaxed);
+    if (needWritable && ((entry & DIRTY_PAGE_BIT) == 0 || (entry & COW_PAGE_BIT) != 0)){
+        COUNT(counters.tlbMisses);
+        return false;
+    }
+    COUNT(counters.tlbHits);
+    frame = entry & FRAME_MASK;
+    return true;
+}
+
+void tlbFill(uint64_t key, word_t entry){
+    TlbEntry &cached = tlb[tlbSlot(key)];
+    cached.tag.store(key + 1, std::memory_order_relaxed);
+    cached.entry.store(entry, std::memory_order_relaxed);
+}
+
+void tlbInvalidate(word_t firstFrame, uint64_t span){
+    for (int i = 0; i < TLB_SIZE; i++) {
+        word_t frame = tlb[i].entry.load(std::memory_order_relaxed) & FRAME_MASK;
+        if (tlb[i].tag.load(std::memory_order_relaxed) != 0 && frame >= firstFrame &&
+            (uint64_t)(frame - firstFrame) < span){
+            tlb[i].tag.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+void tlbInvalidateSpace(int space){
+    for (int i = 0; i < TLB_SIZE; i++) {
+        uint64_t tag = tlb[i].tag.load(std::memory_order_relaxed);
+        if (tag != 0 && (tag - 1) / NUM_PAGES == (uint64_t)space){
+            tlb[i].tag.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+void VMgetStats(VMStats* stats){
+    memset(stats, 0, sizeof(VMStats));
+#ifdef VM_STATS
+    stats->reads = counters.reads.load();
+    stats->writes = counters.writes.load();
+    stats->pageFaults = counters.pageFaults.load();
+    stats->tableAllocations = counters.tableAllocations.load();
+    stats->evictionFallbacks = counters.evictionFallbacks.load();
+    stats->evictions = counters.evictions.load();
+    stats->cleanDrops = counters.cleanDrops.load();
+    stats->zeroFills = counters.zeroFills.load();
+    stats->zeroPageReads = counters.zeroPageReads.load();
+    stats->tlbHits = counters.tlbHits.load();
+    stats->tlbMisses = counters.tlbMisses.load();
+    stats->cowCopies = counters.cowCopies.load();
+    stats->pmEvictCalls = counters.pmEvictCalls.load();
+    stats->pmRestoreCalls = counters.pmRestoreCalls.load();
+    stats->walkReads = counters.physicalReads[WALK_ACCESS].load();
+    stats->walkWrites = counters.physicalWrites[WALK_ACCESS].load();
+    stats->searchReads = counters.physicalReads[SEARCH_ACCESS].load();
+    stats->searchWrites = counters.physicalWrites[SEARCH_ACCESS].load();
+    stats->dataReads = counters.physicalReads[DATA_ACCESS].load();
+    stats->dataWrites = counters.physicalWrites[DATA_ACCESS].load();
+    for (int i = 0; i <= TABLES_DEPTH; i++) {
+        stats->walkLength[i] = counters.walkLength[i].load();
+        stats->searchDepth[i] = counters.searchDepth[i].load();
+    }
+#endif
+}
+
+void VMresetStats(){
+#ifdef VM_STATS
+    counters.reads = 0;
+    counters.writes = 0;
+    counters.pageFaults = 0;
+    counters.tableAllocations = 0;
+    counters.evictionFallbacks = 0;
+    counters.evictions = 0;
+    counters.cleanDrops = 0;
+    counters.zeroFills = 0;
+    counters.zeroPageReads = 0;
+    counters.tlbHits = 0;
+    counters.tlbMisses = 0;
+    counters.cowCopies = 0;
+    counters.pmEvictCalls = 0;
+    counters.pmRestoreCalls = 0;
+    for (int kind = WALK_ACCESS; kind <= DATA_ACCESS; kind++) {
+        counters.physicalReads[kind] = 0;
+        counters.physicalWrites[kind] = 0;
+    }
+    for (int i = 0; i <= TABLES_DEPTH; i++) {
+        counters.walkLength[i] = 0;
+        counters.searchDepth[i] = 0;
+    }
+#endif
+}
+
 void VMinitialize() {
-    clearTable(0);
+    TableUpdate update;
+    for (int space = 1; space < MAX_SPACES; space++) {
+        spaces[space].live = false;
+        spaces[space].users = 0;
+        spaces[space].swapped = std::vector<bool>();
+        spaces[space].hugeLevels = std::map<uint64_t, unsigned char>();
+    }
+    spaces[0].swapped = std::vector<bool>();
+    spaces[0].hugeLevels = std::map<uint64_t, unsigned char>();
+    currentSpace = 0;
+    for (int i = 0; i < TLB_SIZE; i++) {
+        tlb[i].tag.store(0, std::memory_order_relaxed);
+    }
+    clearTable(0, WALK_ACCESS);
 }
 
-void clearTable(uint64_t frameIndex) {
+void clearTable(uint64_t frameIndex, AccessKind kind) {
+    COUNT(counters.zeroFills);
+#ifdef PM_ZERO_OPS
+    PMzeroFrame(frameIndex);
+#else
     for (uint64_t i = 0; i < PAGE_SIZE; ++i) {
-        PMwrite(frameIndex * PAGE_SIZE + i, 0);
+        writeWord(frameIndex * PAGE_SIZE + i, 0, kind);
+    }
+#endif
+}
+
+void bringPageIn(uint64_t frameIndex, int space, uint64_t pageIndex, bool isZero){
+#ifdef PM_ZERO_OPS
+    // a restore overwrites the whole frame, zeros are only needed when the swap has nothing
+    if (PMhasSwapCopy(swapKey(space, pageIndex))){
+        restorePage(frameIndex, space, pageIndex);
+        return;
+    }
+    if (!isZero){
+        clearTable(frameIndex, DATA_ACCESS);
+    }
+#else
+    if (!isZero){
+        clearTable(frameIndex, DATA_ACCESS);
+    }
+    // the swap can only hold a page that went there
+    if (wasSwapped(space, pageIndex, 1)){
+        restorePage(frameIndex, space, pageIndex);
+    }
+#endif
+}
+
+bool isUntouchedPage(int space, uint64_t virtualAddress){
+    if (readLeafEntry(space, virtualAddress) != 0){
+        return false;
+    }
+#ifdef PM_ZERO_OPS
+    return !PMhasSwapCopy(swapKey(space, virtualAddress / PAGE_SIZE));
+#else
+    return !wasSwapped(space, virtualAddress / PAGE_SIZE, 1);
+#endif
+}
+
+bool readUntouchedPage(uint64_t virtualAddress, word_t* value){
+    std::lock_guard<std::mutex> guard(faultLock);
+    if (!spaces[currentSpace].live || !isUntouchedPage(currentSpace, virtualAddress)){
+        return false;
     }
+    // the page gets a frame on its first write
+    COUNT(counters.zeroPageReads);
+    *value = 0;
+    return true;
 }
 
 int VMwrite(uint64_t virtualAddress, word_t value) {
 	if(virtualAddress >=  VIRTUAL_MEMORY_SIZE || (int) virtualAddress < 0){
 		return 0;
 	}
+	COUNT(counters.writes);
+	if(TABLES_DEPTH != 0 && writeMappedPage(virtualAddress, value)){
+		return 1;
+	}
+	TableUpdate update;
 	if(TABLES_DEPTH == 0){
-		word_t  indexOfFrame = getFrameOfVirtualAddress(virtualAddress, 0);
-		PMrestore(indexOfFrame, virtualAddress/PAGE_SIZE);
-		PMwrite(virtualAddress, value);
+		// the only page is the root frame, it is never evicted so it never has to be restored
+		writeWord(virtualAddress, value, DATA_ACCESS);
 		return 1;
 	}
 	else{
+		if(!spaces[currentSpace].live){
+			return 0;
+		}
 		uint64_t numOfBitsInP = CEIL((double)(((double)(VIRTUAL_ADDRESS_WIDTH - OFFSET_WIDTH))/(double)TABLES_DEPTH));
-		word_t  indexOfFrame = getFrameOfVirtualAddress(virtualAddress, numOfBitsInP);
+		word_t  indexOfFrame = getFrameOfVirtualAddress(currentSpace, virtualAddress, numOfBitsInP, true);
+		if(indexOfFrame >= NUM_FRAMES){
+			return 0;
+		}
+		tlbFill(swapKey(currentSpace, virtualAddress / PAGE_SIZE), indexOfFrame | DIRTY_PAGE_BIT);
 		uint64_t onesInLSB = createOnes(OFFSET_WIDTH);
 		uint64_t offset = virtualAddress & onesInLSB;
-		PMrestore((indexOfFrame), virtualAddress/PAGE_SIZE);
-		PMwrite((indexOfFrame * PAGE_SIZE) + offset, value);
+		writeWord((indexOfFrame * PAGE_SIZE) + offset, value, DATA_ACCESS);
 		return 1;
 	}
 
@@ -135,61 +725,318 @@ int VMread(uint64_t virtualAddress, word_t* value) {
 	if(virtualAddress >=  VIRTUAL_MEMORY_SIZE || (int) virtualAddress < 0){
 		return 0;
 	}
+	COUNT(counters.reads);
+	if(TABLES_DEPTH != 0 && (readMappedPage(virtualAddress, value) || readUntouchedPage(virtualAddress, value))){
+		return 1;
+	}
+	TableUpdate update;
 	if(TABLES_DEPTH == 0){
-		word_t  indexOfFrame = getFrameOfVirtualAddress(virtualAddress, 0);
-		PMrestore(indexOfFrame, virtualAddress/PAGE_SIZE);
-		PMread(virtualAddress, value);
+		readWord(virtualAddress, value, DATA_ACCESS);
 		return 1;
 	}
+	if(!spaces[currentSpace].live){
+		return 0;
+	}
 	uint64_t numOfBitsInP = CEIL((double)(((double)(VIRTUAL_ADDRESS_WIDTH - OFFSET_WIDTH))/(double)TABLES_DEPTH));
-    word_t indexOfFrame = getFrameOfVirtualAddress(virtualAddress, numOfBitsInP);
+    word_t indexOfFrame = getFrameOfVirtualAddress(currentSpace, virtualAddress, numOfBitsInP, false);
+    if (indexOfFrame >= NUM_FRAMES){
+        return 0;
+    }
+    tlbFill(swapKey(currentSpace, virtualAddress / PAGE_SIZE), indexOfFrame);
     uint64_t onesInLSB = createOnes(OFFSET_WIDTH);
     uint64_t offset = virtualAddress & onesInLSB;
-    PMrestore((indexOfFrame), virtualAddress/PAGE_SIZE);
-    PMread((indexOfFrame * PAGE_SIZE) + offset, value);
+    readWord((indexOfFrame * PAGE_SIZE) + offset, value, DATA_ACCESS);
     return 1;
 }
 
-word_t getFrameOfVirtualAddress(uint64_t virtualAddress, uint64_t numOfBitsInP){
-    word_t indexOfFrame = 0;
+bool readMappedPage(uint64_t virtualAddress, word_t* value){
+    uint64_t version = tableVersion.load(std::memory_order_acquire);
+    if ((version % 2) != 0){
+        return false;
+    }
+    word_t indexOfFrame;
+    int entriesRead = 0;
+    if (!tlbLookup(swapKey(currentSpace, virtualAddress / PAGE_SIZE), false, indexOfFrame) &&
+        !tryTranslate(currentSpace, virtualAddress, indexOfFrame, false, entriesRead)){
+        return false;
+    }
+    word_t valueInFrame;
+    readWord((indexOfFrame * PAGE_SIZE) + (virtualAddress & createOnes(OFFSET_WIDTH)), &valueInFrame, DATA_ACCESS);
+    // anything read while the version moved may come from a table that was changing
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (tableVersion.load(std::memory_order_relaxed) != version){
+        return false;
+    }
+    if (entriesRead != 0){
+        countWalk(0, entriesRead, false);
+    }
+    *value = valueInFrame;
+    return true;
+}
+
+bool writeMappedPage(uint64_t virtualAddress, word_t value){
+    // a change to the tables waits for registered writers, so the frame can't be evicted under this write.
+    // the first write to a clean page sets its dirty bit on the slow path
+    activeWriters.fetch_add(1);
+    bool mapped = (tableVersion.load() % 2) == 0;
+    word_t indexOfFrame;
+    int entriesRead = 0;
+    if (mapped && (tlbLookup(swapKey(currentSpace, virtualAddress / PAGE_SIZE), true, indexOfFrame) ||
+                   tryTranslate(currentSpace, virtualAddress, indexOfFrame, true, entriesRead))){
+        writeWord((indexOfFrame * PAGE_SIZE) + (virtualAddress & createOnes(OFFSET_WIDTH)), value, DATA_ACCESS);
+        if (entriesRead != 0){
+            countWalk(0, entriesRead, false);
+        }
+    }
+    else{
+        mapped = false;
+    }
+    activeWriters.fetch_sub(1, std::memory_order_release);
+    return mapped;
+}
+
+bool tryTranslate(int space, uint64_t virtualAddress, word_t &frame, bool needDirty, int &entriesRead){
+    uint64_t numOfBitsInP = CEIL((double)(((double)(VIRTUAL_ADDRESS_WIDTH - OFFSET_WIDTH))/(double)TABLES_DEPTH));
+    uint64_t onesInLSB = createOnes(numOfBitsInP);
+    word_t indexOfFrame = spaces[space].root;
     word_t valueInFrame;
+    int walked = TABLES_DEPTH;
+    for (int i = TABLES_DEPTH; i > 0; i--) {
+        uint64_t shiftedVirtualAddress = virtualAddress >> ((numOfBitsInP * (i -1)) + OFFSET_WIDTH);
+        uint64_t P_Address = shiftedVirtualAddress & onesInLSB;
+        readWord((uint64_t)((indexOfFrame * PAGE_SIZE) + P_Address), &valueInFrame, WALK_ACCESS);
+        if (needDirty && (i == 1 || (valueInFrame & HUGE_PAGE_BIT) != 0) &&
+            ((valueInFrame & DIRTY_PAGE_BIT) == 0 || (valueInFrame & COW_PAGE_BIT) != 0)){
+            return false;
+        }
+        if ((valueInFrame & HUGE_PAGE_BIT) != 0){
+            indexOfFrame = (valueInFrame & FRAME_MASK) + ((virtualAddress / PAGE_SIZE) & (hugePageSpan(i - 1) - 1));
+            walked = TABLES_DEPTH - i + 1;
+            break;
+        }
+        // a reader may see a table in the middle of a change, never follow it outside of the memory
+        valueInFrame &= FRAME_MASK;
+        if (valueInFrame <= 0 || valueInFrame >= NUM_FRAMES){
+            return false;
+        }
+        indexOfFrame = valueInFrame;
+    }
+    if (indexOfFrame >= NUM_FRAMES){
+        return false;
+    }
+    entriesRead = walked;
+    frame = indexOfFrame;
+    return true;
+}
+
+word_t readLeafEntry(int space, uint64_t virtualAddress){
+    uint64_t numOfBitsInP = CEIL((double)(((double)(VIRTUAL_ADDRESS_WIDTH - OFFSET_WIDTH))/(double)TABLES_DEPTH));
     uint64_t onesInLSB = createOnes(numOfBitsInP);
+    word_t indexOfFrame = spaces[space].root;
+    word_t valueInFrame = 0;
     for (int i = TABLES_DEPTH; i > 0; i--) {
         uint64_t shiftedVirtualAddress = virtualAddress >> ((numOfBitsInP * (i -1)) + OFFSET_WIDTH);
         uint64_t P_Address = shiftedVirtualAddress & onesInLSB;
-        PMread((uint64_t)((indexOfFrame * PAGE_SIZE) + P_Address), &valueInFrame);
+        readWord((uint64_t)((indexOfFrame * PAGE_SIZE) + P_Address), &valueInFrame, SEARCH_ACCESS);
+        if (valueInFrame == 0 || (valueInFrame & HUGE_PAGE_BIT) != 0){
+            break;
+        }
+        indexOfFrame = valueInFrame & FRAME_MASK;
+    }
+    return valueInFrame;
+}
+
+word_t getFrameOfVirtualAddress(int space, uint64_t virtualAddress, uint64_t numOfBitsInP, bool markDirty){
+    bool isHuge = false;
+    return walkToLevel(space, virtualAddress, numOfBitsInP, 0, markDirty, isHuge);
+}
+
+word_t walkToLevel(int space, uint64_t virtualAddress, uint64_t numOfBitsInP, int lastLevel, bool markDirty,
+                   bool &isHuge){
+    word_t indexOfFrame = spaces[space].root;
+    word_t valueInFrame;
+    uint64_t onesInLSB = createOnes(numOfBitsInP);
+    bool faulted = false;
+    for (int i = TABLES_DEPTH; i > lastLevel; i--) {
+        uint64_t shiftedVirtualAddress = virtualAddress >> ((numOfBitsInP * (i -1)) + OFFSET_WIDTH);
+        uint64_t P_Address = shiftedVirtualAddress & onesInLSB;
+        readWord((uint64_t)((indexOfFrame * PAGE_SIZE) + P_Address), &valueInFrame, WALK_ACCESS);
+        bool endsHere = i == 1 || (valueInFrame & HUGE_PAGE_BIT) != 0;
+        if (markDirty && endsHere && (valueInFrame & COW_PAGE_BIT) != 0){
+            valueInFrame = copyOnWrite(space, indexOfFrame, P_Address, valueInFrame, virtualAddress);
+            if (valueInFrame == 0){
+                return NUM_FRAMES;
+            }
+        }
+        else if (markDirty && endsHere && valueInFrame != 0 && (valueInFrame & DIRTY_PAGE_BIT) == 0){
+            valueInFrame |= DIRTY_PAGE_BIT;
+            writeWord((uint64_t)((indexOfFrame * PAGE_SIZE) + P_Address), valueInFrame, WALK_ACCESS);
+        }
+        if ((valueInFrame & HUGE_PAGE_BIT) != 0){
+            // the rest of the page number is the offset inside the run of frames
+            uint64_t pageInRun = (virtualAddress / PAGE_SIZE) & (hugePageSpan(i - 1) - 1);
+            isHuge = true;
+            countWalk(lastLevel, TABLES_DEPTH - i + 1, faulted);
+            return (valueInFrame & FRAME_MASK) + pageInRun;
+        }
+        if (valueInFrame == 0 && lastLevel == 0 && i > 1 && isHugeRegion(space, virtualAddress, i - 1)){
+            // a huge page that was evicted comes back as one unit, or as pages if there is no free run for it
+            word_t firstFrame = installHuge(space, indexOfFrame, P_Address, virtualAddress, i - 1,
+                                            markDirty ? DIRTY_PAGE_BIT : 0);
+            if (firstFrame < NUM_FRAMES){
+                isHuge = true;
+                countWalk(lastLevel, TABLES_DEPTH - i + 1, true);
+                return firstFrame + ((virtualAddress / PAGE_SIZE) & (hugePageSpan(i - 1) - 1));
+            }
+        }
         if (valueInFrame == 0){
-            word_t indexOfEmptyFrame = findEmptyFrame(indexOfFrame);
-            if (indexOfEmptyFrame >= NUM_FRAMES){
-                indexOfEmptyFrame = findFrameToFreeWrapper(virtualAddress, i);
+            faulted = true;
+            bool isZero = false;
+            word_t indexOfEmptyFrame = allocateFrame(indexOfFrame, virtualAddress, i, isZero);
+            if (indexOfEmptyFrame == 0){
+                // nothing left to evict, the frames are roots or tables on the way here
+                return NUM_FRAMES;
             }
-            PMwrite((uint64_t)((indexOfFrame * PAGE_SIZE) + P_Address), indexOfEmptyFrame);
+            if (i > 1){
+                COUNT(counters.tableAllocations);
+            }
+            word_t newEntry = indexOfEmptyFrame;
+            if (i == 1 && markDirty){
+                newEntry |= DIRTY_PAGE_BIT;
+            }
+            writeWord((uint64_t)((indexOfFrame * PAGE_SIZE) + P_Address), newEntry, WALK_ACCESS);
             indexOfFrame = indexOfEmptyFrame;
-            for(int j = 0; j < PAGE_SIZE; j++){
-                PMwrite((indexOfEmptyFrame*PAGE_SIZE + j), 0);
+            if (i == 1){
+                // the page comes back in, this is the only time it has to be restored
+                bringPageIn(indexOfFrame, space, virtualAddress / PAGE_SIZE, isZero);
+            }
+            else if (!isZero){
+                clearTable(indexOfFrame, WALK_ACCESS);
             }
         }
         else{
-            indexOfFrame = valueInFrame;
+            indexOfFrame = valueInFrame & FRAME_MASK;
         }
     }
+    countWalk(lastLevel, TABLES_DEPTH - lastLevel, faulted);
     return indexOfFrame;
 }
 
+word_t copyOnWrite(int space, word_t tableFrame, uint64_t P_Address, word_t entry, uint64_t virtualAddress){
+    uint64_t entryAddress = (tableFrame * PAGE_SIZE) + P_Address;
+    word_t sharedFrame = entry & FRAME_MASK;
+    tlbInvalidate(sharedFrame, 1);
+    if (frameSharers[sharedFrame] <= 1){
+        // the others already took their own copies
+        entry = (entry & ~COW_PAGE_BIT) | DIRTY_PAGE_BIT;
+        writeWord(entryAddress, entry, WALK_ACCESS);
+        return entry;
+    }
+    COUNT(counters.cowCopies);
+    bool isZero = false;
+    word_t newFrame = allocateFrame(tableFrame, virtualAddress, 1, isZero);
+    if (newFrame == 0){
+        return 0;
+    }
+    word_t valueInFrame;
+    readWord(entryAddress, &valueInFrame, WALK_ACCESS);
+    if (valueInFrame == entry){
+        for (uint64_t i = 0; i < PAGE_SIZE; i++) {
+            word_t word;
+            readWord(sharedFrame * PAGE_SIZE + i, &word, DATA_ACCESS);
+            writeWord(newFrame * PAGE_SIZE + i, word, DATA_ACCESS);
+        }
+        frameSharers[sharedFrame]--;
+    }
+    else{
+        // the shared page was evicted to make room, every space has its own copy in the swap now
+        bringPageIn(newFrame, space, virtualAddress / PAGE_SIZE, isZero);
+    }
+    entry = newFrame | DIRTY_PAGE_BIT;
+    writeWord(entryAddress, entry, WALK_ACCESS);
+    return entry;
+}
+
+void countWalk(int lastLevel, int entriesRead, bool faulted){
+    if (lastLevel != 0){
+        return;
+    }
+    COUNT(counters.walkLength[entriesRead]);
+    if (faulted){
+        COUNT(counters.pageFaults);
+    }
+}
+
 word_t findFrameToFreeWrapper(uint64_t virtualAddress, int currentDepth){
-    word_t indexToStartSearch = 0;
-    uint64_t address = 0;
     uint64_t maxAddress = 0;
     unsigned int maxWeight = 0;
     int maxDepth = 0;
-    unsigned int even = 1;
-    unsigned odd = 0;
-    findFrameToFree(indexToStartSearch, TABLES_DEPTH, address, maxAddress, maxWeight, maxDepth, even,
-    		odd, virtualAddress, currentDepth);
-    word_t frame = simpleVMread(maxAddress, maxDepth);
-    unlinkMax(maxAddress, maxDepth);
-    uint64_t VirtualPage = maxAddress / PAGE_SIZE;
-    PMevict(frame, VirtualPage);
+    int maxSpace = 0;
+    for (int space = 0; space < MAX_SPACES; space++) {
+        if (!spaces[space].live){
+            continue;
+        }
+        word_t indexToStartSearch = spaces[space].root;
+        uint64_t address = 0;
+        uint64_t spaceMaxAddress = 0;
+        unsigned int spaceMaxWeight = 0;
+        int spaceMaxDepth = 0;
+        unsigned int even = indexToStartSearch % 2 == 0 ? 1 : 0;
+        unsigned odd = 1 - even;
+        findFrameToFree(indexToStartSearch, TABLES_DEPTH, address, spaceMaxAddress, spaceMaxWeight, spaceMaxDepth,
+                        even, odd, virtualAddress, currentDepth);
+        if (spaceMaxWeight > maxWeight){
+            maxAddress = spaceMaxAddress;
+            maxWeight = spaceMaxWeight;
+            maxDepth = spaceMaxDepth;
+            maxSpace = space;
+        }
+    }
+    if (maxWeight == 0){
+        // no page to evict, roots can't be victims
+        return 0;
+    }
+    return evictLeaf(maxSpace, maxAddress, maxDepth);
+}
+
+word_t evictLeaf(int space, uint64_t address, int depth){
+    COUNT(counters.evictions);
+    word_t entry = simpleVMread(address, depth, spaces[space].root);
+    unlinkMax(address, depth, spaces[space].root);
+    uint64_t VirtualPage = address / PAGE_SIZE;
+    word_t frame = entry & FRAME_MASK;
+    // huge page goes out as one unit, its other frames become holes
+    uint64_t span = (entry & HUGE_PAGE_BIT) != 0 ? hugePageSpan(TABLES_DEPTH - depth) : 1;
+    tlbInvalidate(frame, span);
+    if ((entry & COW_PAGE_BIT) != 0){
+        // a shared page maps the same address in every space that shares it, each one gets its own copy
+        for (int other = 0; other < MAX_SPACES; other++) {
+            if (other == space || !spaces[other].live){
+                continue;
+            }
+            word_t otherEntry = readLeafEntry(other, address);
+            if ((otherEntry & COW_PAGE_BIT) != 0 && (otherEntry & FRAME_MASK) == frame){
+                unlinkMax(address, TABLES_DEPTH, spaces[other].root);
+                evictPage(frame, other, VirtualPage);
+            }
+        }
+        frameSharers[frame] = 0;
+        evictPage(frame, space, VirtualPage);
+        return frame;
+    }
+    bool keepsCopy = false;
+#ifdef PM_RESTORE_KEEPS_COPY
+    // see PhysicalMemoryExt.h, the swap still holds what a clean page came in with
+    keepsCopy = true;
+#endif
+    // a clean page that never went to the swap came in as zeros, and it comes back as zeros
+    if ((entry & DIRTY_PAGE_BIT) == 0 && (keepsCopy || !wasSwapped(space, VirtualPage, span))){
+        COUNT(counters.cleanDrops);
+        return frame;
+    }
+    for (uint64_t j = 0; j < span; j++) {
+        evictPage(frame + j, space, VirtualPage + j);
+    }
     return frame;
 }
 
@@ -201,20 +1048,31 @@ void findFrameToFree(word_t indexOfFrame, int depth, uint64_t address, uint64_t
         checkMax(even, odd, address, maxAddress, maxWeight, maxDepth, virtualAddress, howFarToShift, depth);
         return;
     }
+    COUNT(counters.searchDepth[TABLES_DEPTH - depth]);
     word_t frameBlock = 0;
     for (uint64_t i = 0; i < PAGE_SIZE; i++) {
-        PMread((uint64_t) ((indexOfFrame * PAGE_SIZE) + i), &frameBlock);
+        readWord((uint64_t) ((indexOfFrame * PAGE_SIZE) + i), &frameBlock, SEARCH_ACCESS);
         int wasEven = 0;
         int wasOdd = 0;
         uint64_t addressAdded = 0;
         if(frameBlock != 0){
-            frameBlock % 2 == 0 ? wasEven++ : wasOdd++;
+            (frameBlock & FRAME_MASK) % 2 == 0 ? wasEven++ : wasOdd++;
         }
         if (frameBlock == 0) {
             continue;
         }
         constructAddressOfFrame(addressAdded, depth, i);
-        findFrameToFree(frameBlock, depth - 1, address + addressAdded, maxAddress, maxWeight, maxDepth,
+        if ((frameBlock & HUGE_PAGE_BIT) != 0){
+            // huge page is a leaf, weighed like the first page it maps
+            uint64_t hugeAddress = address + addressAdded;
+            unsigned int hugeEven = even + wasEven;
+            unsigned int hugeOdd = odd + wasOdd;
+            ((hugeAddress/PAGE_SIZE) % 2) == 0 ? hugeEven++ : hugeOdd++;
+            checkMax(hugeEven, hugeOdd, hugeAddress, maxAddress, maxWeight, maxDepth, virtualAddress,
+                     howFarToShift, depth - 1);
+            continue;
+        }
+        findFrameToFree(frameBlock & FRAME_MASK, depth - 1, address + addressAdded, maxAddress, maxWeight, maxDepth,
         		even+wasEven, odd+wasOdd, virtualAddress,
         		howFarToShift);
     }
@@ -234,104 +1092,443 @@ void checkMax(unsigned int even, unsigned int odd, uint64_t &address, uint64_t &
     }
 }
 
-void unlinkMax(uint64_t maxAddress, int depthOfMax){
+void unlinkMax(uint64_t maxAddress, int depthOfMax, word_t root){
     uint64_t numOfBitsInP = CEIL((double)(((double)(VIRTUAL_ADDRESS_WIDTH - OFFSET_WIDTH))/(double)TABLES_DEPTH));
     uint64_t onesInLSB = createOnes(numOfBitsInP);
     word_t valueInFrame;
-    word_t indexOfFrame = 0;
+    word_t indexOfFrame = root;
     int index = TABLES_DEPTH;
     for (int i = depthOfMax; i > 0 ; i--) {
         uint64_t shiftedVirtualAddress = maxAddress >> (numOfBitsInP * (index-1) + OFFSET_WIDTH);
         uint64_t P_Address = shiftedVirtualAddress & onesInLSB;
         if (i == 1){
-            PMwrite(indexOfFrame * PAGE_SIZE + P_Address, 0);
+            writeWord(indexOfFrame * PAGE_SIZE + P_Address, 0, SEARCH_ACCESS);
             break;
         }
-        PMread((uint64_t)((indexOfFrame * PAGE_SIZE) + P_Address), &valueInFrame);
+        readWord((uint64_t)((indexOfFrame * PAGE_SIZE) + P_Address), &valueInFrame, SEARCH_ACCESS);
         indexOfFrame = valueInFrame;
         index--;
     }
 }
 
 
-word_t simpleVMread(uint64_t virtualAddress, int depth) {
+word_t simpleVMread(uint64_t virtualAddress, int depth, word_t root) {
     uint64_t numOfBitsInP = CEIL((double)(((double)(VIRTUAL_ADDRESS_WIDTH - OFFSET_WIDTH))/(double)TABLES_DEPTH));
     uint64_t onesInLSB = createOnes(numOfBitsInP);
     word_t valueInFrame;
-    word_t indexOfFrame = 0;
-    for (int i = depth; i > 0; i--) {
+    word_t indexOfFrame = root;
+    for (int i = TABLES_DEPTH; i > TABLES_DEPTH - depth; i--) {
         uint64_t shiftedVirtualAddress = virtualAddress >> ((numOfBitsInP * (i -1)) + OFFSET_WIDTH);
         uint64_t P_Address = shiftedVirtualAddress & onesInLSB;
-        PMread((uint64_t)((indexOfFrame * PAGE_SIZE) + P_Address), &valueInFrame);
+        readWord((uint64_t)((indexOfFrame * PAGE_SIZE) + P_Address), &valueInFrame, SEARCH_ACCESS);
         indexOfFrame = valueInFrame;
     }
     return indexOfFrame;
 }
 
 
-int findEmptyFrame(word_t current){
+int findEmptyFrame(word_t current, bool &isZero){
     int max = 0;
-    int depth = 0;
-    bool flag = true;
-    int frame = dfs1(0, 0, current, 0, flag);
+    int referenced = 1;
+    int frame = findEmptyTable(current);
     if (frame != -1){
+        // an empty table holds nothing but zero entries
+        isZero = true;
         return frame;
     }
-    dfs2(0, depth, max);
-    return max + 1;
+    scanSpaces(max, referenced, NULL);
+    if (referenced == max + 1){
+        return max + 1;
+    }
+    return findUnusedFrames(1);
+
+}
+
+word_t allocateFrame(word_t current, uint64_t virtualAddress, int currentDepth, bool &isZero){
+    word_t frame = findEmptyFrame(current, isZero);
+    if (frame >= NUM_FRAMES){
+        COUNT(counters.evictionFallbacks);
+        frame = findFrameToFreeWrapper(virtualAddress, currentDepth);
+    }
+    return frame;
+}
+
+int findEmptyTable(word_t current){
+    for (int space = 0; space < MAX_SPACES; space++) {
+        if (!spaces[space].live){
+            continue;
+        }
+        bool flag = true;
+        int frame = dfs1(spaces[space].root, 0, current, 0, flag, spaces[space].root);
+        if (frame != -1){
+            return frame;
+        }
+    }
+    return -1;
+}
 
+void scanSpaces(int &max, int &referenced, std::vector<bool> *used){
+    for (int space = 0; space < MAX_SPACES; space++) {
+        if (!spaces[space].live){
+            continue;
+        }
+        word_t root = spaces[space].root;
+        if (root != 0){
+            referenced++;
+            if (max < (int)root){
+                max = root;
+            }
+            if (used != NULL){
+                (*used)[root] = true;
+            }
+        }
+        dfs2(root, 0, max, referenced, used);
+    }
+}
+
+void collectLeaves(word_t frame, int depth, uint64_t address, std::vector<Leaf> &leaves){
+    word_t newFrame;
+    for (uint64_t i = 0; i < PAGE_SIZE; i++) {
+        readWord(i + (frame * PAGE_SIZE), &newFrame, SEARCH_ACCESS);
+        if (newFrame == 0){
+            continue;
+        }
+        uint64_t addToAddress = 0;
+        constructAddressOfFrame(addToAddress, TABLES_DEPTH - depth, i);
+        if (depth + 1 == TABLES_DEPTH || (newFrame & HUGE_PAGE_BIT) != 0){
+            Leaf leaf = {address + addToAddress, depth + 1, newFrame};
+            leaves.push_back(leaf);
+            continue;
+        }
+        collectLeaves(newFrame & FRAME_MASK, depth + 1, address + addToAddress, leaves);
+    }
 }
 
 
-void dfs2(word_t frame, int depth, int &max){
+void dfs2(word_t frame, int depth, int &max, int &referenced, std::vector<bool> *used){
     if (depth == TABLES_DEPTH){
         return;
     }
+    COUNT(counters.searchDepth[depth]);
     word_t newFrame;
     for (uint64_t i = 0; i < PAGE_SIZE; i++) {
-        PMread(i + (frame * PAGE_SIZE), &newFrame);
+        readWord(i + (frame * PAGE_SIZE), &newFrame, SEARCH_ACCESS);
         if (newFrame != 0){
-            if (max < newFrame){
-                max = newFrame;
+            uint64_t span = 1;
+            if ((newFrame & HUGE_PAGE_BIT) != 0){
+                span = hugePageSpan(TABLES_DEPTH - depth - 1);
+            }
+            newFrame &= FRAME_MASK;
+            if (max < (int)(newFrame + span - 1)){
+                max = newFrame + span - 1;
+            }
+            referenced += span;
+            if (used != NULL){
+                for (uint64_t j = 0; j < span; j++) {
+                    (*used)[newFrame + j] = true;
+                }
+            }
+            if (span == 1){
+                dfs2(newFrame, depth+1, max, referenced, used);
             }
-            dfs2(newFrame, depth+1, max);
         }
     }
 }
 
-int dfs1(word_t frame, int depth, word_t current, uint64_t address, bool &flag){
+int findUnusedFrames(uint64_t span){
+    int max = 0;
+    int referenced = 1;
+    std::vector<bool> used(NUM_FRAMES, false);
+    used[0] = true;
+    scanSpaces(max, referenced, &used);
+    uint64_t runLength = 0;
+    for (uint64_t frame = 1; frame < NUM_FRAMES; frame++) {
+        runLength = used[frame] ? 0 : runLength + 1;
+        if (runLength == span){
+            return frame - span + 1;
+        }
+    }
+    return NUM_FRAMES;
+}
+
+int dfs1(word_t frame, int depth, word_t current, uint64_t address, bool &flag, word_t root){
     if (depth == TABLES_DEPTH) {
         return -1;
     }
+    COUNT(counters.searchDepth[depth]);
     word_t newFrame;
     int x = 0;
 //    uint64_t tempAddress = address;
     for (uint64_t i = 0; i < PAGE_SIZE; i++) {
-        PMread(i + (frame * PAGE_SIZE), &newFrame);
+        readWord(i + (frame * PAGE_SIZE), &newFrame, SEARCH_ACCESS);
+        if ((newFrame & HUGE_PAGE_BIT) != 0) {
+            x = -1;
+            continue;
+        }
         if (newFrame != 0) {
         	uint64_t addToAddress = 0;
             constructAddressOfFrame (addToAddress, TABLES_DEPTH - depth, i);
-            x = dfs1(newFrame, depth + 1, current, address+addToAddress, flag);
+            x = dfs1(newFrame & FRAME_MASK, depth + 1, current, address+addToAddress, flag, root);
             if (x != -1 && x != current){
                 if (flag){
-                    unlinkMax(address,depth);
+                    unlinkMax(address, depth, root);
                     flag = false;
                 }
                 return x;
             }
         }
     }
-    if (x == -1 || frame == current){
+    // a root stays even when its space is empty
+    if (x == -1 || frame == current || depth == 0){
         return -1;
     }
     if (flag){
-        unlinkMax(address,depth);
+        unlinkMax(address, depth, root);
         flag = false;
     }
     return frame;
 }
 
 
+uint64_t hugePageSpan(int levelsBelow){
+    uint64_t numOfBitsInP = CEIL((double)(((double)(VIRTUAL_ADDRESS_WIDTH - OFFSET_WIDTH))/(double)TABLES_DEPTH));
+    return (uint64_t)1 << (numOfBitsInP * levelsBelow);
+}
+
+int VMmapHuge(uint64_t virtualAddress, int levels){
+    if(virtualAddress >= VIRTUAL_MEMORY_SIZE || levels < 1 || levels >= TABLES_DEPTH){
+        return 0;
+    }
+    TableUpdate update;
+    uint64_t numOfBitsInP = CEIL((double)(((double)(VIRTUAL_ADDRESS_WIDTH - OFFSET_WIDTH))/(double)TABLES_DEPTH));
+    uint64_t span = hugePageSpan(levels);
+    if (span >= NUM_FRAMES || !spaces[currentSpace].live){
+        return 0;
+    }
+    bool isHuge = false;
+    word_t tableFrame = walkToLevel(currentSpace, virtualAddress, numOfBitsInP, levels + 1, false, isHuge);
+    if (isHuge || tableFrame >= NUM_FRAMES){
+        return 0;
+    }
+    uint64_t shiftedVirtualAddress = virtualAddress >> ((numOfBitsInP * levels) + OFFSET_WIDTH);
+    uint64_t P_Address = shiftedVirtualAddress & createOnes(numOfBitsInP);
+    word_t valueInFrame;
+    readWord((uint64_t)((tableFrame * PAGE_SIZE) + P_Address), &valueInFrame, WALK_ACCESS);
+    if (valueInFrame != 0){
+        return 0;
+    }
+    if (installHuge(currentSpace, tableFrame, P_Address, virtualAddress, levels, 0) >= NUM_FRAMES){
+        return 0;
+    }
+    // remembered, so the region comes back huge after it is evicted
+    spaces[currentSpace].hugeLevels[(virtualAddress / PAGE_SIZE) & ~(span - 1)] = levels;
+    return 1;
+}
+
+bool isHugeRegion(int space, uint64_t virtualAddress, int levels){
+    uint64_t firstPage = (virtualAddress / PAGE_SIZE) & ~(hugePageSpan(levels) - 1);
+    std::map<uint64_t, unsigned char>::const_iterator region = spaces[space].hugeLevels.find(firstPage);
+    return region != spaces[space].hugeLevels.end() && region->second == levels;
+}
+
+word_t installHuge(int space, word_t tableFrame, uint64_t P_Address, uint64_t virtualAddress, int levels,
+                   word_t entryBits){
+    uint64_t span = hugePageSpan(levels);
+    int firstFrame = findUnusedFrames(span);
+    for (uint64_t tries = 0; firstFrame >= NUM_FRAMES && tries < 2 * NUM_FRAMES; tries++) {
+        // unlinked empty tables and evicted pages leave holes, stop once they add up to a run
+        if (findEmptyTable(tableFrame) == -1 && findFrameToFreeWrapper(virtualAddress, levels) == 0){
+            break;
+        }
+        firstFrame = findUnusedFrames(span);
+    }
+    if (firstFrame >= NUM_FRAMES){
+        return NUM_FRAMES;
+    }
+    uint64_t firstPage = (virtualAddress / PAGE_SIZE) & ~(span - 1);
+    for (uint64_t j = 0; j < span; j++) {
+        bringPageIn(firstFrame + j, space, firstPage + j, false);
+    }
+    writeWord((uint64_t)((tableFrame * PAGE_SIZE) + P_Address), firstFrame | HUGE_PAGE_BIT | entryBits, WALK_ACCESS);
+    return firstFrame;
+}
+
+int createSpace(){
+#ifndef PM_ADDRESS_SPACES
+    // the swap keys of the other spaces are beyond NUM_PAGES, see PhysicalMemoryExt.h
+    return -1;
+#endif
+    if (TABLES_DEPTH == 0){
+        return -1;
+    }
+    int space = 1;
+    while (space < MAX_SPACES && spaces[space].live) {
+        space++;
+    }
+    if (space == MAX_SPACES){
+        return -1;
+    }
+    // roots are never evicted, a walk needs a frame for every table and the page, and one more to copy on write
+    int roots = 1;
+    for (int other = 0; other < MAX_SPACES; other++) {
+        roots += spaces[other].live ? 1 : 0;
+    }
+    if (NUM_FRAMES - roots < TABLES_DEPTH + 1){
+        return -1;
+    }
+    bool isZero = false;
+    word_t root = allocateFrame(0, 0, 0, isZero);
+    if (root == 0 || root >= NUM_FRAMES){
+        return -1;
+    }
+    if (!isZero){
+        clearTable(root, WALK_ACCESS);
+    }
+    spaces[space].root = root;
+    spaces[space].swapped = std::vector<bool>();
+    spaces[space].hugeLevels = std::map<uint64_t, unsigned char>();
+    spaces[space].live = true;
+    return space;
+}
+
+void destroySpace(int space){
+    std::vector<Leaf> leaves;
+    collectLeaves(spaces[space].root, 0, 0, leaves);
+    for (size_t i = 0; i < leaves.size(); i++) {
+        if ((leaves[i].entry & COW_PAGE_BIT) != 0){
+            frameSharers[leaves[i].entry & FRAME_MASK]--;
+        }
+    }
+#ifdef PM_ADDRESS_SPACES
+    // the next space in this slot gets the same swap keys
+    for (uint64_t page = 0; page < spaces[space].swapped.size(); page++) {
+        if (spaces[space].swapped[page]){
+            PMdiscard(swapKey(space, page));
+        }
+    }
+#endif
+    tlbInvalidateSpace(space);
+    // its frames are free once nothing links them
+    spaces[space].live = false;
+    spaces[space].swapped = std::vector<bool>();
+    spaces[space].hugeLevels = std::map<uint64_t, unsigned char>();
+}
+
+int VMcreateSpace(){
+    TableUpdate update;
+    return createSpace();
+}
+
+int VMcloneSpace(int source){
+    if (source < 0 || source >= MAX_SPACES){
+        return -1;
+    }
+    TableUpdate update;
+    if (!spaces[source].live){
+        return -1;
+    }
+    int space = createSpace();
+    if (space == -1){
+        return -1;
+    }
+    uint64_t numOfBitsInP = CEIL((double)(((double)(VIRTUAL_ADDRESS_WIDTH - OFFSET_WIDTH))/(double)TABLES_DEPTH));
+    uint64_t onesInLSB = createOnes(numOfBitsInP);
+    std::vector<Leaf> leaves;
+    collectLeaves(spaces[source].root, 0, 0, leaves);
+    for (size_t i = 0; i < leaves.size(); i++) {
+        // huge pages are not shared, they go to the swap and come back as pages
+        if ((leaves[i].entry & HUGE_PAGE_BIT) != 0){
+            evictLeaf(source, leaves[i].address, leaves[i].depth);
+        }
+    }
+    leaves.clear();
+    collectLeaves(spaces[source].root, 0, 0, leaves);
+    for (size_t i = 0; i < leaves.size(); i++) {
+        bool isHuge = false;
+        word_t tableFrame = walkToLevel(space, leaves[i].address, numOfBitsInP, 1, false, isHuge);
+        if (tableFrame >= NUM_FRAMES){
+            destroySpace(space);
+            return -1;
+        }
+        // making room for the tables may have evicted the page, then it is copied from the swap below
+        if (readLeafEntry(source, leaves[i].address) == 0){
+            continue;
+        }
+        word_t sourceTable = walkToLevel(source, leaves[i].address, numOfBitsInP, 1, false, isHuge);
+        uint64_t P_Address = (leaves[i].address / PAGE_SIZE) & onesInLSB;
+        word_t entry;
+        readWord((uint64_t)((sourceTable * PAGE_SIZE) + P_Address), &entry, WALK_ACCESS);
+        word_t frame = entry & FRAME_MASK;
+        if ((entry & COW_PAGE_BIT) == 0){
+            frameSharers[frame] = 1;
+            writeWord((uint64_t)((sourceTable * PAGE_SIZE) + P_Address), entry | COW_PAGE_BIT, WALK_ACCESS);
+        }
+        frameSharers[frame]++;
+        writeWord((uint64_t)((tableFrame * PAGE_SIZE) + P_Address), frame | COW_PAGE_BIT, WALK_ACCESS);
+        tlbInvalidate(frame, 1);
+    }
+    // the huge pages of source come back huge in the copy too
+    spaces[space].hugeLevels = spaces[source].hugeLevels;
+    if (spaces[source].swapped.empty()){
+        return space;
+    }
+    // the swap can't share, pages that are only there are copied through a frame that nothing links
+    bool isZero = false;
+    word_t scratch = allocateFrame(spaces[space].root, 0, 0, isZero);
+    if (scratch == 0 || scratch >= NUM_FRAMES){
+        destroySpace(space);
+        return -1;
+    }
+    for (uint64_t page = 0; page < NUM_PAGES; page++) {
+        if (!spaces[source].swapped[page] || readLeafEntry(source, page * PAGE_SIZE) != 0){
+            continue;
+        }
+        if (!spaces[space].swapped.empty() && spaces[space].swapped[page]){
+            continue;
+        }
+        restorePage(scratch, source, page);
+        evictPage(scratch, space, page);
+#ifndef PM_RESTORE_KEEPS_COPY
+        // the restore took it out of the swap
+        evictPage(scratch, source, page);
+#endif
+    }
+    return space;
+}
+
+int VMdestroySpace(int space){
+    if (space <= 0 || space >= MAX_SPACES || space == currentSpace){
+        return 0;
+    }
+    TableUpdate update;
+    // another thread may be walking its tables without the lock
+    if (!spaces[space].live || spaces[space].users != 0){
+        return 0;
+    }
+    destroySpace(space);
+    return 1;
+}
+
+int VMswitchSpace(int space){
+    if (space < 0 || space >= MAX_SPACES){
+        return 0;
+    }
+    std::lock_guard<std::mutex> guard(faultLock);
+    if (!spaces[space].live){
+        return 0;
+    }
+    // space 0 can't be destroyed, threads start on it without counting
+    (void)&spaceUser;
+    if (currentSpace != 0){
+        spaces[currentSpace].users--;
+    }
+    if (space != 0){
+        spaces[space].users++;
+    }
+    currentSpace = space;
+    return 1;
+}
+
 uint64_t createOnes(uint64_t numOfBitsInP){
     uint64_t onesBit = 0;
     for(uint64_t i = 0; i < numOfBitsInP; i++){
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "MemoryConstants.h"
+
+/** num of address spaces that can live at once */
+#define MAX_SPACES 8
+
+/**
+ * map the aligned region around virtualAddress as one huge page, a single table entry that points to a
+ * contiguous run of frames instead of a lower table. translations of the region stop at that entry, and the
+ * whole run is evicted together. the region is remembered, the first access after an eviction restores the
+ * whole run as one huge page again, or as ordinary pages while there is no free run of frames for it.
+ * @param virtualAddress any address in the region
+ * @param levels num of table levels that the huge page replaces, between 1 and TABLES_DEPTH - 1
+ * @return 1 on success, 0 if the region is already mapped or there is no free run of frames
+ */
+int VMmapHuge(uint64_t virtualAddress, int levels);
+
+/**
+ * paging counters, they only count when the library is built with -DVM_STATS
+ */
+typedef struct VMStats{
+    uint64_t reads;
+    uint64_t writes;
+    /** translations that found a missing table or page on the way */
+    uint64_t pageFaults;
+    uint64_t tableAllocations;
+    /** faults where findEmptyFrame() had nothing to give and a page was evicted */
+    uint64_t evictionFallbacks;
+    /** pages (or huge pages) that were evicted */
+    uint64_t evictions;
+    /** evictions of clean pages that skipped PMevict, they never went to the swap or the swap keeps a copy */
+    uint64_t cleanDrops;
+    /** frames that were zeroed, frames that dfs1() found empty are already zero and skip it */
+    uint64_t zeroFills;
+    /** reads of never written pages that returned 0 without a frame */
+    uint64_t zeroPageReads;
+    /** lookups of the translation cache by VMread and VMwrite that did not take the fault lock */
+    uint64_t tlbHits;
+    uint64_t tlbMisses;
+    /** writes to a page shared copy on write that had to copy it */
+    uint64_t cowCopies;
+    uint64_t pmEvictCalls;
+    uint64_t pmRestoreCalls;
+    /** physical accesses of the translation walk */
+    uint64_t walkReads;
+    uint64_t walkWrites;
+    /** physical accesses of the searches for an empty frame or a page to evict */
+    uint64_t searchReads;
+    uint64_t searchWrites;
+    /** physical accesses of the value itself, and of zeroing pages */
+    uint64_t dataReads;
+    uint64_t dataWrites;
+    /** walkLength[i] is the num of translations that read i table entries */
+    uint64_t walkLength[TABLES_DEPTH + 1];
+    /** searchDepth[i] is the num of tables at depth i that the searches scanned */
+    uint64_t searchDepth[TABLES_DEPTH + 1];
+} VMStats;
+
+/**
+ * copy the paging counters, all zero when built without VM_STATS
+ * @param stats where to copy
+ */
+void VMgetStats(VMStats* stats);
+
+/**
+ * zero the paging counters
+ */
+void VMresetStats();
+
+/**
+ * address spaces share the physical memory, each one has its own tables and its own pages in the swap.
+ * space 0 is the one VMinitialize() sets up, and every thread starts on it. VMread, VMwrite and VMmapHuge
+ * act on the current space of the calling thread. page p of space s goes to the swap as page s * NUM_PAGES + p,
+ * so every space but 0 needs a physical memory with PM_ADDRESS_SPACES (see PhysicalMemoryExt.h), without it
+ * VMcreateSpace and VMcloneSpace fail.
+ */
+
+/**
+ * create an empty address space
+ * @return its id, -1 if MAX_SPACES are alive, there is no frame for its root, or the roots would leave fewer
+ * than TABLES_DEPTH + 1 frames for the walks
+ */
+int VMcreateSpace();
+
+/**
+ * create an address space with the same content as source, like fork. pages in memory are shared copy on
+ * write, pages in the swap are copied. huge pages of source are evicted first.
+ * @param source id of the space to copy
+ * @return id of the copy, -1 on failure
+ */
+int VMcloneSpace(int source);
+
+/**
+ * free the tables and pages of an address space, and drop its pages from the swap
+ * @param space id, space 0 can't be destroyed
+ * @return 1 on success, 0 if the space does not exist or it is the current space of a thread, a thread that
+ * exits leaves its space
+ */
+int VMdestroySpace(int space);
+
+/**
+ * make an address space the current one of the calling thread, translations of other spaces stay cached
+ * @param space id
+ * @return 1 on success, 0 if the space does not exist
+ */
+int VMswitchSpace(int space);
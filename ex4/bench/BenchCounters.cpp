@@ -0,0 +1,68 @@
+#include "PhysicalMemory.h"
+#include "PhysicalMemoryExt.h"
+#include "BenchPhysicalMemory.h"
+#include <chrono>
+
+static bool timing = false;
+static thread_local PMBenchCounters counters;
+
+/**
+ * ns since some fixed point
+ */
+static inline uint64_t now(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void PMread(uint64_t physicalAddress, word_t* value){
+    counters.reads++;
+    if (!timing){
+        PMbackendRead(physicalAddress, value);
+        return;
+    }
+    uint64_t start = now();
+    PMbackendRead(physicalAddress, value);
+    counters.readNs += now() - start;
+}
+
+void PMwrite(uint64_t physicalAddress, word_t value){
+    counters.writes++;
+    if (!timing){
+        PMbackendWrite(physicalAddress, value);
+        return;
+    }
+    uint64_t start = now();
+    PMbackendWrite(physicalAddress, value);
+    counters.writeNs += now() - start;
+}
+
+void PMevict(uint64_t frameIndex, uint64_t evictedPageIndex){
+    uint64_t start = now();
+    counters.evicts++;
+    PMbackendEvict(frameIndex, evictedPageIndex);
+    counters.evictNs += now() - start;
+}
+
+void PMrestore(uint64_t frameIndex, uint64_t restoredPageIndex){
+    // asked before the clock starts, a backend without a kept copy drops it on the restore
+    if (PMhasSwapCopy(restoredPageIndex)){
+        counters.restoreHits++;
+    }
+    uint64_t start = now();
+    counters.restores++;
+    PMbackendRestore(frameIndex, restoredPageIndex);
+    counters.restoreNs += now() - start;
+}
+
+void PMzeroFrame(uint64_t frameIndex){
+    counters.zeroFrames++;
+    PMbackendZeroFrame(frameIndex);
+}
+
+PMBenchCounters& PMbenchCounters(){
+    return counters;
+}
+
+void PMbenchSetTiming(bool enabled){
+    timing = enabled;
+}
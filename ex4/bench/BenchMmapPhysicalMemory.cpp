@@ -0,0 +1,6 @@
+#include "MmapPhysicalMemory.h"
+#include "BenchPhysicalMemory.h"
+
+void PMbenchReset(){
+    PMmmapReset();
+}
@@ -0,0 +1,68 @@
+#include "PhysicalMemory.h"
+#include "PhysicalMemoryExt.h"
+#include "BenchPhysicalMemory.h"
+#include <vector>
+#include <unordered_map>
+#include <cassert>
+#include <algorithm>
+
+typedef std::vector<word_t> page_t;
+
+/** the RAM, PMread and PMwrite may run on many threads at once */
+static std::vector<word_t> RAM(RAM_SIZE, 0);
+/**
+ * the swap, VirtualMemory.cpp only evicts and restores under its fault lock.
+ * with PM_RESTORE_KEEPS_COPY a restored page keeps its copy until the next PMevict overwrites it
+ */
+static std::unordered_map<uint64_t, page_t> swapFile;
+
+void PMread(uint64_t physicalAddress, word_t* value){
+    assert(physicalAddress < RAM_SIZE);
+    *value = RAM[physicalAddress];
+}
+
+void PMwrite(uint64_t physicalAddress, word_t value){
+    assert(physicalAddress < RAM_SIZE);
+    RAM[physicalAddress] = value;
+}
+
+void PMevict(uint64_t frameIndex, uint64_t evictedPageIndex){
+    assert(frameIndex < NUM_FRAMES);
+    assert(evictedPageIndex < NUM_SWAP_PAGES);
+#ifndef PM_RESTORE_KEEPS_COPY
+    assert(swapFile.find(evictedPageIndex) == swapFile.end());
+#endif
+    swapFile[evictedPageIndex] = page_t(RAM.begin() + frameIndex * PAGE_SIZE,
+                                        RAM.begin() + (frameIndex + 1) * PAGE_SIZE);
+}
+
+void PMrestore(uint64_t frameIndex, uint64_t restoredPageIndex){
+    assert(frameIndex < NUM_FRAMES);
+    assert(restoredPageIndex < NUM_SWAP_PAGES);
+    std::unordered_map<uint64_t, page_t>::iterator page = swapFile.find(restoredPageIndex);
+    if (page != swapFile.end()){
+        std::copy(page->second.begin(), page->second.end(), RAM.begin() + frameIndex * PAGE_SIZE);
+#ifndef PM_RESTORE_KEEPS_COPY
+        swapFile.erase(page);
+#endif
+    }
+}
+
+void PMzeroFrame(uint64_t frameIndex){
+    assert(frameIndex < NUM_FRAMES);
+    std::fill(RAM.begin() + frameIndex * PAGE_SIZE, RAM.begin() + (frameIndex + 1) * PAGE_SIZE, 0);
+}
+
+bool PMhasSwapCopy(uint64_t pageIndex){
+    return swapFile.find(pageIndex) != swapFile.end();
+}
+
+void PMdiscard(uint64_t pageIndex){
+    assert(pageIndex < NUM_SWAP_PAGES);
+    swapFile.erase(pageIndex);
+}
+
+void PMbenchReset(){
+    std::fill(RAM.begin(), RAM.end(), 0);
+    swapFile.clear();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "MemoryConstants.h"
+
+/**
+ * what the physical memory saw, kept per thread so hits can count without a lock
+ */
+typedef struct PMBenchCounters{
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t evicts;
+    uint64_t restores;
+    /** restores that found the page in the swap */
+    uint64_t restoreHits;
+    /** PMzeroFrame calls, each one stands for PAGE_SIZE writes */
+    uint64_t zeroFrames;
+    /** time spent in each call, reads and writes are only timed with PMbenchSetTiming(true) */
+    uint64_t readNs;
+    uint64_t writeNs;
+    uint64_t evictNs;
+    uint64_t restoreNs;
+} PMBenchCounters;
+
+/**
+ * @return counters of the calling thread
+ */
+PMBenchCounters& PMbenchCounters();
+
+/**
+ * zero the RAM and drop the swap, for a fresh run. each backend has its own
+ */
+void PMbenchReset();
+
+/**
+ * time every PMread and PMwrite, costs two clock reads per access
+ * @param enabled
+ */
+void PMbenchSetTiming(bool enabled);
+
+/*
+ * BenchCounters.cpp has PMread, PMwrite, PMevict, PMrestore and PMzeroFrame, they count and time the call and
+ * pass it on to the backend. the backend is compiled with BENCHRENAME from the Makefile, so its own functions
+ * are the ones below. PMhasSwapCopy and PMdiscard are not counted and keep their names
+ */
+void PMbackendRead(uint64_t physicalAddress, word_t* value);
+void PMbackendWrite(uint64_t physicalAddress, word_t value);
+void PMbackendEvict(uint64_t frameIndex, uint64_t evictedPageIndex);
+void PMbackendRestore(uint64_t frameIndex, uint64_t restoredPageIndex);
+void PMbackendZeroFrame(uint64_t frameIndex);
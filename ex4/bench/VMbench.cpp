@@ -0,0 +1,378 @@
+#include "VirtualMemory.h"
+#include "VirtualMemoryExt.h"
+#include "BenchPhysicalMemory.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+
+#define USAGE "usage: vmbench [--pattern seq|stride|random|zipf|loop|all] [--trace FILE] [--dump FILE]\n" \
+              "               [--accesses N] [--footprint PAGES] [--writes PERCENT] [--threads N]\n" \
+              "               [--spaces N] [--seed N] [--verify] [--pm-timing] [--scaling]\n"
+#define ZIPF_SKEW 0.99
+/** num of accesses between two switches of address space, with --spaces */
+#define SWITCH_EVERY 64
+#define LOOP_EXTRA_PAGES 2
+/** with --scaling all the threads together touch this part of the frames, so the pages stay resident */
+#define SCALING_RESIDENT_SHARE 4
+
+/**
+ * one virtual access of a trace
+ */
+typedef struct Access{
+    bool write;
+    uint64_t address;
+} Access;
+
+/**
+ * what one thread measured
+ */
+typedef struct RunResult{
+    uint64_t ns;
+    uint64_t accesses;
+    uint64_t mismatches;
+    PMBenchCounters pm;
+} RunResult;
+
+/**
+ * command line options
+ */
+typedef struct Options{
+    std::string pattern = "all";
+    std::string trace;
+    std::string dump;
+    uint64_t accesses = 200000;
+    uint64_t footprint = NUM_FRAMES * 4;
+    unsigned int writes = 30;
+    unsigned int threads = 1;
+    unsigned int spaces = 1;
+    unsigned int seed = 1;
+    bool verify = false;
+    bool pmTiming = false;
+    bool scaling = false;
+} Options;
+
+/**
+ * build a synthetic trace
+ * @param pattern seq, stride, random, zipf or loop
+ * @param count num of accesses
+ * @param footprint num of pages the trace touches
+ * @param writes percent of writes
+ * @param seed
+ * @param trace where to add the accesses
+ * @return false if the pattern is unknown
+ */
+bool makeTrace(const std::string &pattern, uint64_t count, uint64_t footprint, unsigned int writes,
+               unsigned int seed, std::vector<Access> &trace){
+    std::mt19937_64 random(seed);
+    uint64_t words = footprint * PAGE_SIZE;
+    std::vector<double> zipf;
+    if (pattern == "zipf"){
+        // cdf of page popularity, page i is hit in proportion to 1 / (i + 1)^s
+        zipf.resize(footprint);
+        double sum = 0;
+        for (uint64_t page = 0; page < footprint; page++) {
+            sum += 1.0 / pow((double)(page + 1), ZIPF_SKEW);
+            zipf[page] = sum;
+        }
+    }
+    // the loop is a bit bigger than the RAM, so it misses on every page with any recency policy
+    uint64_t loopWords = std::min<uint64_t>(words, (NUM_FRAMES + LOOP_EXTRA_PAGES) * PAGE_SIZE);
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t address;
+        if (pattern == "seq"){
+            address = i % words;
+        }
+        else if (pattern == "stride"){
+            address = (i * (PAGE_SIZE + 1)) % words;
+        }
+        else if (pattern == "random"){
+            address = random() % words;
+        }
+        else if (pattern == "zipf"){
+            double pick = std::uniform_real_distribution<double>(0, zipf.back())(random);
+            uint64_t page = std::lower_bound(zipf.begin(), zipf.end(), pick) - zipf.begin();
+            address = std::min(page, footprint - 1) * PAGE_SIZE + random() % PAGE_SIZE;
+        }
+        else if (pattern == "loop"){
+            address = (i * PAGE_SIZE) % loopWords;
+        }
+        else{
+            return false;
+        }
+        Access access = {(unsigned int)(random() % 100) < writes, address};
+        trace.push_back(access);
+    }
+    return true;
+}
+
+/**
+ * read a trace, one access per line: "r ADDRESS" or "w ADDRESS", addresses in decimal or 0x hex
+ * @param path
+ * @param trace where to add the accesses
+ * @return false if the file can't be read
+ */
+bool readTrace(const std::string &path, std::vector<Access> &trace){
+    std::ifstream in(path.c_str());
+    if (!in){
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        std::string address;
+        if (!(fields >> kind >> address) || kind[0] == '#'){
+            continue;
+        }
+        Access access = {kind == "w" || kind == "W", strtoull(address.c_str(), NULL, 0)};
+        trace.push_back(access);
+    }
+    return true;
+}
+
+/**
+ * write a trace in the format that readTrace() reads
+ */
+bool writeTrace(const std::string &path, const std::vector<Access> &trace){
+    std::ofstream out(path.c_str());
+    for (size_t i = 0; i < trace.size() && out; i++) {
+        out << (trace[i].write ? "w 0x" : "r 0x") << std::hex << trace[i].address << std::dec << "\n";
+    }
+    return (bool)out;
+}
+
+/**
+ * replay a trace on one thread
+ * @param trace
+ * @param base added to every address, so threads get their own part of the virtual memory
+ * @param spaces num of address spaces to take turns on, every SWITCH_EVERY accesses
+ * @param verify compare every read with the last value written
+ * @param result
+ */
+void replay(const std::vector<Access> &trace, uint64_t base, unsigned int spaces, bool verify, RunResult &result){
+    std::unordered_map<uint64_t, word_t> written;
+    PMbenchCounters() = PMBenchCounters();
+    result.mismatches = 0;
+    uint64_t space = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < trace.size(); i++) {
+        if (spaces > 1 && i % SWITCH_EVERY == 0){
+            space = (i / SWITCH_EVERY) % spaces;
+            VMswitchSpace((int)space);
+        }
+        uint64_t address = (base + trace[i].address) % VIRTUAL_MEMORY_SIZE;
+        word_t value = (word_t)(address * 2654435761u + i);
+        // the same address in two spaces is two different words
+        uint64_t key = space * VIRTUAL_MEMORY_SIZE + address;
+        if (trace[i].write){
+            VMwrite(address, value);
+            if (verify){
+                written[key] = value;
+            }
+            continue;
+        }
+        VMread(address, &value);
+        if (verify){
+            std::unordered_map<uint64_t, word_t>::iterator last = written.find(key);
+            if (value != (last == written.end() ? 0 : last->second)){
+                result.mismatches++;
+            }
+        }
+    }
+    result.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    result.accesses = trace.size();
+    result.pm = PMbenchCounters();
+}
+
+/**
+ * run a trace on fresh memory and print one line of results
+ * @return num of mismatches that --verify found
+ */
+uint64_t runTrace(const std::string &name, const std::vector<Access> &trace, const Options &options){
+    PMbenchReset();
+    VMinitialize();
+    for (unsigned int space = 1; space < options.spaces; space++) {
+        VMcreateSpace();
+    }
+    VMresetStats();
+    PMbenchSetTiming(options.pmTiming);
+    std::vector<RunResult> results(options.threads);
+    std::vector<std::thread> workers;
+    uint64_t slice = VIRTUAL_MEMORY_SIZE / options.threads;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned int t = 0; t < options.threads; t++) {
+        workers.push_back(std::thread(replay, std::cref(trace), t * slice, options.spaces, options.verify,
+                                      std::ref(results[t])));
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    double wall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    RunResult total = RunResult();
+    for (size_t t = 0; t < results.size(); t++) {
+        total.accesses += results[t].accesses;
+        total.mismatches += results[t].mismatches;
+        total.pm.reads += results[t].pm.reads;
+        total.pm.writes += results[t].pm.writes;
+        total.pm.evicts += results[t].pm.evicts;
+        total.pm.restores += results[t].pm.restores;
+        total.pm.restoreHits += results[t].pm.restoreHits;
+        total.pm.zeroFrames += results[t].pm.zeroFrames;
+        total.pm.readNs += results[t].pm.readNs;
+        total.pm.writeNs += results[t].pm.writeNs;
+        total.pm.evictNs += results[t].pm.evictNs;
+        total.pm.restoreNs += results[t].pm.restoreNs;
+    }
+    VMStats stats;
+    VMgetStats(&stats);
+    double accesses = total.accesses == 0 ? 1 : (double)total.accesses;
+    printf("%-8s %9llu %8.1f %9.3f %9.2f %9.2f %9.4f %9.4f %9.4f %10.1f",
+           name.c_str(), (unsigned long long)total.accesses, wall / accesses,
+           stats.pageFaults / accesses, total.pm.reads / accesses, total.pm.writes / accesses,
+           total.pm.evicts / accesses, total.pm.restoreHits / accesses, total.pm.zeroFrames / accesses,
+           total.accesses / wall * 1000);
+    if (options.pmTiming){
+        printf("  pm ns read %.1f write %.1f evict %.1f restore %.1f",
+               total.pm.readNs / (double)std::max<uint64_t>(total.pm.reads, 1),
+               total.pm.writeNs / (double)std::max<uint64_t>(total.pm.writes, 1),
+               total.pm.evictNs / (double)std::max<uint64_t>(total.pm.evicts, 1),
+               total.pm.restoreNs / (double)std::max<uint64_t>(total.pm.restores, 1));
+    }
+    if (options.verify){
+        printf("  mismatches %llu", (unsigned long long)total.mismatches);
+    }
+    printf("\n");
+    return total.mismatches;
+}
+
+/**
+ * parse the command line
+ * @return false on a bad argument
+ */
+bool parseOptions(int argc, char** argv, Options &options){
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--verify"){
+            options.verify = true;
+        }
+        else if (arg == "--pm-timing"){
+            options.pmTiming = true;
+        }
+        else if (arg == "--scaling"){
+            options.scaling = true;
+        }
+        else if (!hasValue){
+            return false;
+        }
+        else if (arg == "--pattern"){
+            options.pattern = argv[++i];
+        }
+        else if (arg == "--trace"){
+            options.trace = argv[++i];
+        }
+        else if (arg == "--dump"){
+            options.dump = argv[++i];
+        }
+        else if (arg == "--accesses"){
+            options.accesses = strtoull(argv[++i], NULL, 0);
+        }
+        else if (arg == "--footprint"){
+            options.footprint = strtoull(argv[++i], NULL, 0);
+        }
+        else if (arg == "--writes"){
+            options.writes = atoi(argv[++i]);
+        }
+        else if (arg == "--threads"){
+            options.threads = atoi(argv[++i]);
+        }
+        else if (arg == "--spaces"){
+            options.spaces = atoi(argv[++i]);
+        }
+        else if (arg == "--seed"){
+            options.seed = atoi(argv[++i]);
+        }
+        else{
+            return false;
+        }
+    }
+    return options.threads > 0 && options.spaces > 0 && options.spaces <= MAX_SPACES;
+}
+
+int main(int argc, char** argv){
+    Options options;
+    if (!parseOptions(argc, argv, options)){
+        std::cerr << USAGE;
+        return EXIT_FAILURE;
+    }
+    if (options.scaling){
+        // the hit path without faults, every thread count gets the same resident pages per thread
+        options.footprint = NUM_FRAMES / SCALING_RESIDENT_SHARE / options.threads;
+    }
+    // every thread gets its own slice of the virtual memory
+    options.footprint = std::max<uint64_t>(1, std::min<uint64_t>(options.footprint,
+                                                                   NUM_PAGES / options.threads));
+    printf("# PAGE_SIZE %lld NUM_FRAMES %lld NUM_PAGES %lld TABLES_DEPTH %d threads %u spaces %u footprint %llu pages\n",
+           (long long)PAGE_SIZE, (long long)NUM_FRAMES, (long long)NUM_PAGES, (int)TABLES_DEPTH,
+           options.threads, options.spaces, (unsigned long long)options.footprint);
+    printf("%-8s %9s %8s %9s %9s %9s %9s %9s %9s %10s\n", "trace", "accesses", "ns/acc", "faults",
+           "pmR/acc", "pmW/acc", "evict", "restore", "zero", "Macc/s");
+    std::vector<std::string> names;
+    if (!options.trace.empty()){
+        names.push_back(options.trace);
+    }
+    else if (options.pattern == "all"){
+        const char* patterns[] = {"seq", "stride", "random", "zipf", "loop"};
+        names.assign(patterns, patterns + 5);
+    }
+    else{
+        names.push_back(options.pattern);
+    }
+    uint64_t mismatches = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        std::vector<Access> trace;
+        bool ok = options.trace.empty()
+                  ? makeTrace(names[i], options.accesses, options.footprint, options.writes,
+                              options.seed, trace)
+                  : readTrace(options.trace, trace);
+        if (!ok){
+            std::cerr << "vmbench: can't load trace " << names[i] << "\n" << USAGE;
+            return EXIT_FAILURE;
+        }
+        if (!options.dump.empty()){
+            std::string path = names.size() == 1 ? options.dump : options.dump + "." + names[i];
+            if (!writeTrace(path, trace)){
+                std::cerr << "vmbench: can't write " << path << "\n";
+                return EXIT_FAILURE;
+            }
+        }
+        std::string name = options.trace.empty() ? names[i] : "trace";
+        if (!options.scaling){
+            mismatches += runTrace(name, trace, options);
+            continue;
+        }
+        // one line per thread count, 1, 2, 4 and so on, and --threads last even if it is not a power of 2
+        Options run = options;
+        for (run.threads = 1; ; run.threads = std::min(run.threads * 2, options.threads)) {
+            std::ostringstream label;
+            label << name << "/" << run.threads;
+            mismatches += runTrace(label.str(), trace, run);
+            if (run.threads == options.threads){
+                break;
+            }
+        }
+    }
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}